@@ -0,0 +1,663 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buddy.h"
+
+/**
+ * Regression tests for arena geometries and features the simulator's
+ * fixtures cannot reach. Prints one line per failed check and exits
+ * non-zero if there was any.
+ */
+
+static int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			printf("%s:%d: check failed: %s\n",		\
+			       __FILE__, __LINE__, #cond);		\
+			++failures;					\
+		}							\
+	} while (0)
+
+/**
+ * Slab arenas with pages smaller than a slab header
+ */
+static void test_slab_small_pages(void)
+{
+	static char region[1 << 17] __attribute__((aligned(1 << 17)));
+	void* objs[64];
+
+	for (int min_order = 4; min_order <= 6; ++min_order) {
+		struct buddy_arena_opts opts = {
+			.min_order = min_order,
+			.flags = BUDDY_ARENA_SLAB,
+		};
+		buddy_arena_t* arena = buddy_arena_create_opts(region, sizeof(region), &opts);
+
+		CHECK(arena != NULL);
+		if (arena == NULL)
+			continue;
+
+		for (int i = 0; i < 64; ++i) {
+			objs[i] = buddy_arena_alloc(arena, 16 << (i % 8));
+			CHECK(objs[i] != NULL);
+			if (objs[i] != NULL)
+				memset(objs[i], i, 16 << (i % 8));
+		}
+		for (int i = 0; i < 64; ++i) {
+			CHECK(objs[i] == NULL || *(unsigned char*)objs[i] == i);
+			buddy_arena_free(arena, objs[i]);
+		}
+		buddy_arena_destroy(arena);
+	}
+}
+
+/**
+ * A slab arena whose blocks cannot hold a slab of the largest class is
+ * rejected
+ */
+static void test_slab_max_order_too_small(void)
+{
+	struct buddy_arena_opts opts = {
+		.min_order = 4,
+		.max_order = 6,
+		.flags = BUDDY_ARENA_SLAB,
+	};
+
+	CHECK(buddy_arena_create_opts(NULL, 1 << 16, &opts) == NULL);
+	opts.flags = 0;
+	buddy_arena_t* arena = buddy_arena_create_opts(NULL, 1 << 16, &opts);
+	CHECK(arena != NULL);
+	buddy_arena_destroy(arena);
+}
+
+/**
+ * Shard sets reject the options plain arenas reject, and clean up after a
+ * shard that cannot be created
+ */
+static void test_shards_create(void)
+{
+	struct buddy_arena_opts opts = { .min_order = 12 };
+
+	buddy_shards_t* shards = buddy_shards_create(4 << 20, 4, &opts);
+	CHECK(shards != NULL);
+	buddy_shards_destroy(shards);
+
+	// 1 MiB shards have no blocks of order 21
+	opts.max_order = 21;
+	CHECK(buddy_shards_create(4 << 20, 4, &opts) == NULL);
+	CHECK(buddy_arena_create_opts(NULL, 1 << 20, &opts) == NULL);
+
+	// More shards than pthread keys: the shards after the last key fail
+	opts.max_order = 0;
+	CHECK(buddy_shards_create((size_t)2048 << 12, 2048, &opts) == NULL);
+	shards = buddy_shards_create(4 << 20, 4, &opts);
+	CHECK(shards != NULL);
+	buddy_shards_destroy(shards);
+}
+
+/**
+ * Reallocating in place is counted like a move, so the fragmentation
+ * figures see the new size, and the live figures drop back on free
+ */
+static void test_realloc_stats(void)
+{
+	struct buddy_arena_opts opts = { .min_order = 12 };
+	buddy_arena_t* arena = buddy_arena_create_opts(NULL, 1 << 20, &opts);
+	struct buddy_stats stats;
+
+	CHECK(arena != NULL);
+	if (arena == NULL)
+		return;
+
+	void* addr = buddy_arena_alloc(arena, 64 << 10);
+	CHECK(buddy_arena_realloc(arena, addr, 4 << 10) == addr);
+	CHECK(buddy_arena_realloc(arena, addr, 6 << 10) == addr);
+
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.allocs == 3 && stats.frees == 2);
+	CHECK(stats.total_bytes_requested == (64 + 4 + 6) << 10);
+	CHECK(stats.total_bytes_allocated == (64 + 4 + 8) << 10);
+	CHECK(stats.bytes_requested == 6 << 10 && stats.bytes_allocated == 8 << 10);
+	CHECK(stats.internal_fragmentation == 0.25);
+
+	buddy_arena_free(arena, addr);
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.bytes_requested == 0 && stats.bytes_allocated == 0);
+	CHECK(stats.internal_fragmentation == 0);
+	buddy_arena_destroy(arena);
+}
+
+/**
+ * Live byte counts of slab objects and exact allocations, which keep their
+ * slack apart from the page slack of plain blocks
+ */
+static void test_live_stats(void)
+{
+	struct buddy_arena_opts opts = {
+		.min_order = 12,
+		.flags = BUDDY_ARENA_SLAB | BUDDY_ARENA_THREADSAFE,
+	};
+	buddy_arena_t* arena = buddy_arena_create_opts(NULL, 1 << 20, &opts);
+	struct buddy_stats stats;
+	void* small[32];
+
+	CHECK(arena != NULL);
+	if (arena == NULL)
+		return;
+
+	for (int i = 0; i < 32; ++i)
+		small[i] = buddy_arena_alloc(arena, 24);
+	void* exact = buddy_arena_alloc_exact(arena, 80 << 10);
+	void* block = buddy_arena_alloc(arena, 5000);
+
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.bytes_requested == 32 * 24 + (80 << 10) + 5000);
+	CHECK(stats.bytes_allocated == 32 * 32 + (80 << 10) + 8192);
+
+	buddy_arena_free_bulk(arena, small, 32);
+	buddy_arena_free(arena, exact);
+	buddy_arena_free(arena, block);
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.bytes_requested == 0 && stats.bytes_allocated == 0);
+	CHECK(stats.allocs == 34 && stats.frees == 34);
+	buddy_arena_destroy(arena);
+}
+
+/**
+ * Allocate and free a few pages from a thread that then exits
+ */
+static void* magazine_worker(void* arg)
+{
+	buddy_arena_t* arena = arg;
+	void* blocks[8];
+
+	for (int i = 0; i < 8; ++i)
+		blocks[i] = buddy_arena_alloc(arena, 4096);
+	for (int i = 0; i < 8; ++i)
+		buddy_arena_free(arena, blocks[i]);
+	return NULL;
+}
+
+/**
+ * Magazines refill and drain half a magazine (16 blocks) at a time, and
+ * flushing or exiting the thread returns everything they hold
+ */
+static void test_magazines(void)
+{
+	struct buddy_arena_opts opts = {
+		.min_order = 12,
+		.flags = BUDDY_ARENA_THREADSAFE,
+	};
+	buddy_arena_t* arena = buddy_arena_create_opts(NULL, 1 << 20, &opts);
+	struct buddy_stats stats;
+	void* blocks[48];
+	pthread_t thread;
+
+	CHECK(arena != NULL);
+	if (arena == NULL)
+		return;
+
+	blocks[0] = buddy_arena_alloc(arena, 4096);
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.bytes_free == (1 << 20) - 16 * 4096);
+	buddy_arena_free(arena, blocks[0]);
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.bytes_free == (1 << 20) - 16 * 4096);
+
+	// 16 from the magazine, then two refills
+	for (int i = 0; i < 48; ++i)
+		blocks[i] = buddy_arena_alloc(arena, 4096);
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.bytes_free == (1 << 20) - 48 * 4096);
+
+	// The 33rd free drains 16 blocks; the magazine ends up full again
+	for (int i = 0; i < 48; ++i)
+		buddy_arena_free(arena, blocks[i]);
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.bytes_free == (1 << 20) - 32 * 4096);
+
+	buddy_arena_flush(arena);
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.bytes_free == 1 << 20 && stats.largest_free == 1 << 20);
+
+	CHECK(pthread_create(&thread, NULL, magazine_worker, arena) == 0);
+	pthread_join(thread, NULL);
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.bytes_free == 1 << 20 && stats.largest_free == 1 << 20);
+	CHECK(stats.allocs == 57 && stats.frees == 57);
+	buddy_arena_destroy(arena);
+}
+
+#define LF_THREADS 4
+#define LF_BLOCKS 32
+#define LF_ROUNDS 500
+
+struct lf_worker {
+	buddy_arena_t* arena;
+	pthread_barrier_t* barrier;
+	void* blocks[LF_BLOCKS];
+	int id;
+	int bad;
+};
+
+/**
+ * Tag of block i of a worker's round, written to the first and last word of
+ * the block while the worker holds it
+ */
+static unsigned long lf_tag(const struct lf_worker* w, int round, int i)
+{
+	return ((unsigned long)w->id << 32) | ((unsigned long)round << 8) | i;
+}
+
+/**
+ * Churn one- and two-page blocks through the lock-free stacks, checking
+ * that no other thread writes to a block while this one holds it, then
+ * hold a last set of blocks until every worker has one
+ */
+static void* lf_worker(void* arg)
+{
+	struct lf_worker* w = arg;
+
+	for (int round = 0; round < LF_ROUNDS; ++round) {
+		for (int i = 0; i < LF_BLOCKS; ++i) {
+			size_t size = 4096 << (i & 1);
+			unsigned long* block = buddy_arena_alloc(w->arena, size);
+
+			w->blocks[i] = block;
+			if (block == NULL) {
+				++w->bad;
+				continue;
+			}
+			block[0] = block[size / sizeof(long) - 1] = lf_tag(w, round, i);
+		}
+		for (int i = 0; i < LF_BLOCKS; ++i) {
+			size_t size = 4096 << (i & 1);
+			unsigned long* block = w->blocks[i];
+
+			if (block == NULL)
+				continue;
+			if (block[0] != lf_tag(w, round, i) ||
+			    block[size / sizeof(long) - 1] != lf_tag(w, round, i))
+				++w->bad;
+			buddy_arena_free(w->arena, block);
+		}
+	}
+
+	for (int i = 0; i < LF_BLOCKS; ++i)
+		w->blocks[i] = buddy_arena_alloc(w->arena, 4096);
+	pthread_barrier_wait(w->barrier);
+	return NULL;
+}
+
+/**
+ * qsort() comparator of block addresses
+ */
+static int cmp_addr(const void* a, const void* b)
+{
+	const char* x = *(void* const*)a;
+	const char* y = *(void* const*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Threads racing on the lock-free stacks each get their own blocks: no
+ * block is handed out twice, and all of them come back on flush
+ */
+static void test_lockfree_stacks(void)
+{
+	struct buddy_arena_opts opts = {
+		.min_order = 12,
+		.flags = BUDDY_ARENA_LOCKFREE,
+	};
+	buddy_arena_t* arena = buddy_arena_create_opts(NULL, 8 << 20, &opts);
+	struct lf_worker workers[LF_THREADS];
+	pthread_t threads[LF_THREADS];
+	pthread_barrier_t barrier;
+	void* held[LF_THREADS * LF_BLOCKS];
+	struct buddy_stats stats;
+
+	CHECK(arena != NULL);
+	if (arena == NULL)
+		return;
+
+	pthread_barrier_init(&barrier, NULL, LF_THREADS);
+	for (int t = 0; t < LF_THREADS; ++t) {
+		workers[t] = (struct lf_worker){ .arena = arena, .barrier = &barrier, .id = t };
+		CHECK(pthread_create(&threads[t], NULL, lf_worker, &workers[t]) == 0);
+	}
+	for (int t = 0; t < LF_THREADS; ++t) {
+		pthread_join(threads[t], NULL);
+		CHECK(workers[t].bad == 0);
+		memcpy(&held[t * LF_BLOCKS], workers[t].blocks, sizeof(workers[t].blocks));
+	}
+	pthread_barrier_destroy(&barrier);
+
+	qsort(held, LF_THREADS * LF_BLOCKS, sizeof(held[0]), cmp_addr);
+	CHECK(held[0] != NULL);
+	for (int i = 1; i < LF_THREADS * LF_BLOCKS; ++i)
+		CHECK((char*)held[i] - (char*)held[i - 1] >= 4096);
+
+	buddy_arena_free_bulk(arena, held, LF_THREADS * LF_BLOCKS);
+	buddy_arena_flush(arena);
+	buddy_arena_stats(arena, &stats);
+	CHECK(stats.bytes_free == 8 << 20 && stats.largest_free == 8 << 20);
+	buddy_arena_destroy(arena);
+}
+
+/**
+ * Bulk allocation splits each block once per piece it yields and bulk free
+ * merges every buddy pair back, on both engines. Every split adds one block
+ * to the arena's partition and every merge removes one, so splitting the
+ * whole arena takes one split less than the blocks it ends up in.
+ */
+static void test_bulk_coalesce(void)
+{
+	static void* blocks[256];
+	unsigned int engines[] = { 0, BUDDY_ARENA_TREE };
+
+	for (int e = 0; e < 2; ++e) {
+		struct buddy_arena_opts opts = { .min_order = 12, .flags = engines[e] };
+		buddy_arena_t* arena = buddy_arena_create_opts(NULL, 1 << 20, &opts);
+		struct buddy_stats stats;
+
+		CHECK(arena != NULL);
+		if (arena == NULL)
+			continue;
+
+		CHECK(buddy_arena_alloc_bulk(arena, 3000, 256, blocks) == 256);
+		CHECK(buddy_arena_alloc_bulk(arena, 4096, 1, blocks) == 0);
+		buddy_arena_stats(arena, &stats);
+		CHECK(stats.splits == 255 && stats.merges == 0);
+		CHECK(stats.bytes_free == 0 && stats.failed_allocs[12] == 1);
+
+		// Free the odd pages first so no pair is complete within a batch
+		void* odd[128];
+		void* even[128];
+		for (int i = 0; i < 128; ++i) {
+			odd[i] = blocks[2 * i + 1];
+			even[i] = blocks[2 * i];
+		}
+		buddy_arena_free_bulk(arena, odd, 128);
+		buddy_arena_stats(arena, &stats);
+		CHECK(stats.merges == 0 && stats.bytes_free == 128 * 4096);
+		buddy_arena_free_bulk(arena, even, 128);
+		buddy_arena_stats(arena, &stats);
+		CHECK(stats.merges == 255);
+		CHECK(stats.bytes_free == 1 << 20 && stats.largest_free == 1 << 20);
+		CHECK(stats.allocs == 256 && stats.frees == 256);
+
+		// Eight 16 KiB blocks next to free 128, 256 and 512 KiB blocks
+		CHECK(buddy_arena_alloc_bulk(arena, 16 << 10, 8, blocks) == 8);
+		buddy_arena_stats(arena, &stats);
+		CHECK(stats.splits == 255 + 10 && stats.largest_free == 512 << 10);
+		buddy_arena_free_bulk(arena, blocks, 8);
+		buddy_arena_stats(arena, &stats);
+		CHECK(stats.merges == 255 + 10 && stats.largest_free == 1 << 20);
+		buddy_arena_destroy(arena);
+	}
+}
+
+/**
+ * Allocate two pages that are buddies of each other
+ *
+ * @param lo receives the lower page
+ * @param hi receives the upper page
+ */
+static void alloc_buddies(buddy_arena_t* arena, char** lo, char** hi)
+{
+	char* a = buddy_arena_alloc(arena, 4096);
+	char* b = buddy_arena_alloc(arena, 4096);
+
+	*lo = a < b ? a : b;
+	*hi = a < b ? b : a;
+	CHECK(a != NULL && b != NULL && *hi - *lo == 4096);
+	memset(*lo, 'l', 4096);
+	memset(*hi, 'h', 4096);
+}
+
+/**
+ * A page grows in place when its buddy to the right is free and moves, with
+ * its data, when that buddy is in use or the free buddy is to its left
+ */
+static void test_realloc_grow(void)
+{
+	unsigned int engines[] = { 0, BUDDY_ARENA_TREE };
+
+	for (int e = 0; e < 2; ++e) {
+		struct buddy_arena_opts opts = { .min_order = 12, .flags = engines[e] };
+		buddy_arena_t* arena = buddy_arena_create_opts(NULL, 1 << 20, &opts);
+		struct buddy_stats stats;
+		char* lo;
+		char* hi;
+		char* addr;
+
+		CHECK(arena != NULL);
+		if (arena == NULL)
+			continue;
+
+		// Right buddy free: grow in place
+		alloc_buddies(arena, &lo, &hi);
+		buddy_arena_free(arena, hi);
+		addr = buddy_arena_realloc(arena, lo, 8192);
+		CHECK(addr == lo && buddy_arena_usable_size(arena, addr) == 8192);
+		CHECK(addr[0] == 'l' && addr[4095] == 'l');
+		buddy_arena_stats(arena, &stats);
+		CHECK(stats.bytes_free == (1 << 20) - 8192);
+		buddy_arena_free(arena, addr);
+
+		// Right buddy in use: move
+		alloc_buddies(arena, &lo, &hi);
+		addr = buddy_arena_realloc(arena, lo, 8192);
+		CHECK(addr != NULL && addr != lo && buddy_arena_usable_size(arena, addr) == 8192);
+		CHECK(addr[0] == 'l' && addr[4095] == 'l' && hi[0] == 'h');
+		buddy_arena_stats(arena, &stats);
+		CHECK(stats.bytes_free == (1 << 20) - 8192 - 4096);
+		buddy_arena_free(arena, addr);
+		buddy_arena_free(arena, hi);
+
+		// Left buddy free: a block only grows to the right, so move
+		alloc_buddies(arena, &lo, &hi);
+		buddy_arena_free(arena, lo);
+		addr = buddy_arena_realloc(arena, hi, 8192);
+		CHECK(addr != NULL && addr != hi && buddy_arena_usable_size(arena, addr) == 8192);
+		CHECK(addr[0] == 'h' && addr[4095] == 'h');
+		buddy_arena_free(arena, addr);
+
+		buddy_arena_stats(arena, &stats);
+		CHECK(stats.bytes_free == 1 << 20 && stats.largest_free == 1 << 20);
+		buddy_arena_destroy(arena);
+	}
+}
+
+/**
+ * Pages freed into a lazy arena stay pending until a request no free block
+ * can serve, which coalesces them all; a page request reuses one without
+ * any split
+ */
+static void test_lazy_drain(void)
+{
+	static void* pages[256];
+	unsigned int engines[] = { 0, BUDDY_ARENA_TREE };
+
+	for (int e = 0; e < 2; ++e) {
+		struct buddy_arena_opts opts = {
+			.min_order = 12,
+			.flags = BUDDY_ARENA_LAZY | engines[e],
+			.lazy_high = 256,
+		};
+		buddy_arena_t* arena = buddy_arena_create_opts(NULL, 1 << 20, &opts);
+		struct buddy_stats stats;
+
+		CHECK(arena != NULL);
+		if (arena == NULL)
+			continue;
+
+		CHECK(buddy_arena_alloc_bulk(arena, 4096, 256, pages) == 256);
+		for (int i = 0; i < 256; ++i)
+			buddy_arena_free(arena, pages[i]);
+		buddy_arena_stats(arena, &stats);
+		CHECK(stats.merges == 0 && stats.bytes_free == 0);
+
+		void* page = buddy_arena_alloc(arena, 4096);
+		buddy_arena_stats(arena, &stats);
+		CHECK(page != NULL && stats.splits == 255 && stats.bytes_free == 0);
+
+		// No free block of two pages: drain the 255 pending pages
+		void* pair = buddy_arena_alloc(arena, 8192);
+		buddy_arena_stats(arena, &stats);
+		CHECK(pair != NULL && stats.merges > 0);
+		CHECK(stats.bytes_free == (1 << 20) - 4096 - 8192);
+		CHECK(stats.failed_allocs[13] == 0);
+
+		buddy_arena_free(arena, page);
+		buddy_arena_free(arena, pair);
+		buddy_arena_flush(arena);
+		buddy_arena_stats(arena, &stats);
+		CHECK(stats.bytes_free == 1 << 20 && stats.largest_free == 1 << 20);
+		buddy_arena_destroy(arena);
+	}
+}
+
+struct remote_test {
+	buddy_shards_t* shards;
+	int cpu;       // CPU of the home shard, cpu % 2
+	int other_cpu; // CPU of the other shard, -1 if none is allowed
+	void* block;
+};
+
+/**
+ * Run fn(arg) on a thread pinned to cpu and wait for it
+ */
+static void run_on_cpu(int cpu, void* (*fn)(void*), void* arg)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	CHECK(pthread_create(&thread, &attr, fn, arg) == 0);
+	pthread_join(thread, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+static void* remote_free(void* arg)
+{
+	struct remote_test* t = arg;
+
+	buddy_shards_free(t->shards, t->block);
+	return NULL;
+}
+
+static void* remote_alloc(void* arg)
+{
+	struct remote_test* t = arg;
+
+	t->block = buddy_shards_alloc(t->shards, 4096);
+	return NULL;
+}
+
+/**
+ * Frees of the other shard's blocks from the home shard's CPU, which queue
+ * on the other shard
+ */
+static void* remote_owner(void* arg)
+{
+	struct remote_test* t = arg;
+	buddy_arena_t* home = buddy_shards_arena(t->shards, t->cpu % 2);
+	buddy_arena_t* other = buddy_shards_arena(t->shards, 1 - t->cpu % 2);
+	struct buddy_stats stats;
+
+	// Fill the home shard so the next page is stolen from the other one
+	void* big = buddy_shards_alloc(t->shards, 1 << 20);
+	CHECK(big != NULL && buddy_arena_owns(home, big));
+	t->block = buddy_shards_alloc(t->shards, 4096);
+	CHECK(t->block != NULL && buddy_arena_owns(other, t->block));
+	CHECK(buddy_shards_steals(t->shards) == 1);
+
+	run_on_cpu(t->cpu, remote_free, t);
+	buddy_arena_stats(other, &stats);
+	CHECK(stats.frees == 0);
+
+	if (t->other_cpu >= 0) {
+		// Its next allocation drains the other shard's queue first
+		run_on_cpu(t->other_cpu, remote_alloc, t);
+		buddy_arena_stats(other, &stats);
+		CHECK(stats.frees == 1 && buddy_shards_steals(t->shards) == 1);
+	} else {
+		// The home shard is full: every queue is drained before stealing
+		t->block = buddy_shards_alloc(t->shards, 4096);
+		buddy_arena_stats(other, &stats);
+		CHECK(stats.frees == 1 && buddy_shards_steals(t->shards) == 2);
+	}
+	CHECK(t->block != NULL && buddy_arena_owns(other, t->block));
+
+	run_on_cpu(t->cpu, remote_free, t);
+	buddy_shards_free(t->shards, big);
+	buddy_shards_flush(t->shards);
+	for (int i = 0; i < 2; ++i) {
+		buddy_arena_stats(buddy_shards_arena(t->shards, i), &stats);
+		CHECK(stats.bytes_free == 1 << 20 && stats.allocs == stats.frees);
+	}
+	return NULL;
+}
+
+/**
+ * A block freed from another shard's CPU waits on its shard's remote-free
+ * queue and is freed by the owning shard's next allocation (or, with a
+ * single CPU, before an allocation steals from that shard)
+ */
+static void test_shards_remote_free(void)
+{
+	struct buddy_arena_opts opts = { .min_order = 12 };
+	struct remote_test t = { .cpu = -1, .other_cpu = -1 };
+	cpu_set_t allowed;
+
+	CHECK(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		if (t.cpu < 0)
+			t.cpu = cpu;
+		else if (t.other_cpu < 0 && cpu % 2 != t.cpu % 2)
+			t.other_cpu = cpu;
+	}
+
+	t.shards = buddy_shards_create(2 << 20, 2, &opts);
+	CHECK(t.shards != NULL && buddy_shards_count(t.shards) == 2);
+	if (t.shards == NULL)
+		return;
+	run_on_cpu(t.cpu, remote_owner, &t);
+	buddy_shards_destroy(t.shards);
+}
+
+int main(void)
+{
+	test_slab_small_pages();
+	test_slab_max_order_too_small();
+	test_shards_create();
+	test_realloc_stats();
+	test_live_stats();
+	test_magazines();
+	test_lockfree_stacks();
+	test_bulk_coalesce();
+	test_realloc_grow();
+	test_lazy_drain();
+	test_shards_remote_free();
+
+	if (failures > 0) {
+		printf("%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("All arena tests passed\n");
+	return EXIT_SUCCESS;
+}
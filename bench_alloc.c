@@ -0,0 +1,437 @@
+#include <getopt.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buddy.h"
+
+/**
+ * Single-threaded allocator benchmark: runs synthetic workloads against a
+ * buddy arena and against glibc malloc and reports throughput, latency
+ * percentiles and the worst fragmentation seen.
+ *
+ * Every workload draws its sizes from one distribution (fixed, uniform or
+ * power-law) and then either fills a live set and frees it in LIFO, FIFO or
+ * random order, or churns a full live set by replacing random objects.
+ *
+ * Latencies include the cost of reading the clock around each call. The
+ * internal fragmentation is 1 - peak live bytes / peak bytes held by the
+ * allocator, the external fragmentation the worst 1 - largest free block /
+ * free bytes sampled during the run.
+ */
+
+#define SAMPLE_EVERY 256 ///< operations between two fragmentation samples
+
+/**
+ * Size distributions
+ */
+typedef enum dist_t {
+	DIST_FIXED,
+	DIST_UNIFORM,
+	DIST_POWERLAW
+} dist_t;
+
+static const char* dist_names[] = { "fixed", "uniform", "powerlaw" };
+
+/**
+ * Allocation and free patterns
+ */
+typedef enum pattern_t {
+	PATTERN_LIFO,
+	PATTERN_FIFO,
+	PATTERN_RANDOM,
+	PATTERN_CHURN
+} pattern_t;
+
+static const char* pattern_names[] = { "lifo", "fifo", "random", "churn" };
+
+/**
+ * An allocator under test
+ */
+typedef struct allocator_t {
+	const char* name;
+	void* (*alloc)(size_t size);
+	void (*free)(void* addr);
+	/* bytes the allocator holds for live objects and the external
+	 * fragmentation of its free memory, negative if unknown */
+	void (*usage)(size_t* in_use, double* ext_frag);
+} allocator_t;
+
+/**
+ * Benchmark parameters
+ */
+typedef struct params_t {
+	size_t fixed_size;
+	size_t min_size;
+	size_t max_size;
+	int live;
+	int rounds;
+	long churn_ops;
+} params_t;
+
+/**
+ * Results of one run
+ */
+typedef struct result_t {
+	double ns_per_op;
+	uint32_t p50, p99, p999;
+	double int_frag;
+	double ext_frag;
+	long fails;
+} result_t;
+
+static buddy_arena_t* arena;
+
+static void* arena_alloc(size_t size)
+{
+	return buddy_arena_alloc(arena, size);
+}
+
+static void arena_free(void* addr)
+{
+	buddy_arena_free(arena, addr);
+}
+
+static void arena_usage(size_t* in_use, double* ext_frag)
+{
+	struct buddy_stats stats;
+
+	buddy_arena_stats(arena, &stats);
+	*in_use = stats.bytes_in_use;
+	*ext_frag = stats.external_fragmentation;
+}
+
+static void* libc_alloc(size_t size)
+{
+	return malloc(size);
+}
+
+static void libc_free(void* addr)
+{
+	free(addr);
+}
+
+static void libc_usage(size_t* in_use, double* ext_frag)
+{
+	struct mallinfo2 info = mallinfo2();
+
+	*in_use = info.uordblks + info.hblkhd;
+	*ext_frag = -1;
+}
+
+static const allocator_t allocators[] = {
+	{ "buddy", arena_alloc, arena_free, arena_usage },
+	{ "malloc", libc_alloc, libc_free, libc_usage },
+};
+
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Draw a request size
+ *
+ * The power-law distribution has density proportional to size^-2 between
+ * min_size and max_size, so small requests dominate but every size class
+ * up to max_size shows up.
+ *
+ * @param dist Size distribution
+ * @param p Benchmark parameters
+ * @param seed rand_r() state
+ */
+static size_t draw_size(dist_t dist, const params_t* p, unsigned int* seed)
+{
+	double u;
+
+	switch (dist) {
+	case DIST_FIXED:
+		return p->fixed_size;
+	case DIST_UNIFORM:
+		return p->min_size + rand_r(seed) % (p->max_size - p->min_size + 1);
+	case DIST_POWERLAW:
+	default:
+		u = (double)rand_r(seed) / ((double)RAND_MAX + 1);
+		return p->min_size / (1 - u * (1 - (double)p->min_size / p->max_size));
+	}
+}
+
+/**
+ * Records per-operation latencies and the peak fragmentation of one run
+ */
+typedef struct recorder_t {
+	const allocator_t* a;
+	uint32_t* lat;
+	long n;
+	uint64_t total;
+	size_t base;
+	size_t live_bytes;
+	size_t peak_live;
+	size_t peak_in_use;
+	double ext_frag;
+	long fails;
+} recorder_t;
+
+/**
+ * Sample fragmentation every SAMPLE_EVERY operations, outside the timed
+ * region
+ */
+static void sample(recorder_t* r)
+{
+	size_t in_use;
+	double ext;
+
+	if (r->n % SAMPLE_EVERY != 0)
+		return;
+
+	r->a->usage(&in_use, &ext);
+	in_use -= in_use > r->base ? r->base : in_use;
+	if (in_use > r->peak_in_use)
+		r->peak_in_use = in_use;
+	if (ext > r->ext_frag)
+		r->ext_frag = ext;
+}
+
+/**
+ * Allocate size bytes, timing the call
+ */
+static void* timed_alloc(recorder_t* r, size_t size)
+{
+	uint64_t start = now_ns();
+	void* addr = r->a->alloc(size);
+	uint64_t ns = now_ns() - start;
+
+	r->lat[r->n++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+	r->total += ns;
+	if (addr == NULL)
+		r->fails++;
+	else
+		r->live_bytes += size;
+	if (r->live_bytes > r->peak_live)
+		r->peak_live = r->live_bytes;
+	sample(r);
+	return addr;
+}
+
+/**
+ * Free a block of size bytes, timing the call
+ */
+static void timed_free(recorder_t* r, void* addr, size_t size)
+{
+	uint64_t start = now_ns();
+	r->a->free(addr);
+	uint64_t ns = now_ns() - start;
+
+	r->lat[r->n++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+	r->total += ns;
+	if (addr != NULL)
+		r->live_bytes -= size;
+	sample(r);
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Run one workload against one allocator
+ *
+ * @param a Allocator under test
+ * @param dist Size distribution
+ * @param pattern Allocation and free pattern
+ * @param p Benchmark parameters
+ * @param res Filled in with the results
+ */
+static int run(const allocator_t* a, dist_t dist, pattern_t pattern,
+	       const params_t* p, result_t* res)
+{
+	long max_ops = pattern == PATTERN_CHURN ?
+		2 * (p->live + p->churn_ops) : 2l * p->live * p->rounds;
+	void** live = calloc(p->live, sizeof(void*));
+	size_t* sizes = calloc(p->live, sizeof(size_t));
+	int* order = calloc(p->live, sizeof(int));
+	recorder_t r = { .a = a, .lat = calloc(max_ops, sizeof(uint32_t)), .ext_frag = -1 };
+	unsigned int seed = 1;
+	double ext;
+
+	if (live == NULL || sizes == NULL || order == NULL || r.lat == NULL) {
+		fprintf(stderr, "ERROR: Out of memory for %ld samples\n", max_ops);
+		return -1;
+	}
+	/* the benchmark's own bookkeeping comes from malloc too */
+	a->usage(&r.base, &ext);
+
+	if (pattern == PATTERN_CHURN) {
+		for (int i = 0; i < p->live; ++i) {
+			sizes[i] = draw_size(dist, p, &seed);
+			live[i] = timed_alloc(&r, sizes[i]);
+		}
+		for (long i = 0; i < p->churn_ops; ++i) {
+			int slot = rand_r(&seed) % p->live;
+			timed_free(&r, live[slot], sizes[slot]);
+			sizes[slot] = draw_size(dist, p, &seed);
+			live[slot] = timed_alloc(&r, sizes[slot]);
+		}
+		for (int i = 0; i < p->live; ++i)
+			timed_free(&r, live[i], sizes[i]);
+	}
+	else {
+		for (int round = 0; round < p->rounds; ++round) {
+			for (int i = 0; i < p->live; ++i) {
+				sizes[i] = draw_size(dist, p, &seed);
+				live[i] = timed_alloc(&r, sizes[i]);
+				order[i] = pattern == PATTERN_LIFO ? p->live - 1 - i : i;
+			}
+			if (pattern == PATTERN_RANDOM) {
+				for (int i = p->live - 1; i > 0; --i) {
+					int j = rand_r(&seed) % (i + 1);
+					int t = order[i];
+					order[i] = order[j];
+					order[j] = t;
+				}
+			}
+			for (int i = 0; i < p->live; ++i)
+				timed_free(&r, live[order[i]], sizes[order[i]]);
+		}
+	}
+
+	qsort(r.lat, r.n, sizeof(uint32_t), cmp_u32);
+	res->ns_per_op = (double)r.total / r.n;
+	res->p50 = r.lat[r.n / 2];
+	res->p99 = r.lat[r.n * 99 / 100];
+	res->p999 = r.lat[r.n * 999 / 1000];
+	res->int_frag = r.peak_in_use > r.peak_live ?
+		1 - (double)r.peak_live / r.peak_in_use : 0;
+	res->ext_frag = r.ext_frag;
+	res->fails = r.fails;
+
+	free(r.lat);
+	free(order);
+	free(sizes);
+	free(live);
+	return 0;
+}
+
+/**
+ * Output program manual
+ *
+ * @param prog_name Name of the program passed in as a command line argument.
+ * @param out File stream to write to.
+ */
+static void print_usage(char* prog_name, FILE* out)
+{
+	fprintf(out, "Usage:\n");
+	fprintf(out, "  %s [-a size] [-p order] [-f flags] [-z size] [-m size] [-M size]\n", prog_name);
+	fprintf(out, "     [-l live] [-r rounds] [-c ops]\n");
+	fprintf(out, "     -a [optional] - Arena size in bytes (default 1 GiB).\n");
+	fprintf(out, "     -p [optional] - log2 of the arena page size (default 12).\n");
+	fprintf(out, "     -f [optional] - BUDDY_ARENA_* flags of the arena (default 0).\n");
+	fprintf(out, "     -z [optional] - Size of the fixed workloads (default 4096).\n");
+	fprintf(out, "     -m [optional] - Smallest random size (default 16).\n");
+	fprintf(out, "     -M [optional] - Largest random size (default 65536).\n");
+	fprintf(out, "     -l [optional] - Live objects per workload (default 4096).\n");
+	fprintf(out, "     -r [optional] - Fill and free rounds (default 50).\n");
+	fprintf(out, "     -c [optional] - Replacements in the churn workloads (default 1000000).\n");
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	size_t arena_size = 1ul << 30;
+	struct buddy_arena_opts opts = { .min_order = 12 };
+	params_t p = {
+		.fixed_size = 4096,
+		.min_size = 16,
+		.max_size = 65536,
+		.live = 4096,
+		.rounds = 50,
+		.churn_ops = 1000000,
+	};
+
+	while ((opt = getopt(argc, argv, "a:p:f:z:m:M:l:r:c:")) != -1) {
+		switch (opt) {
+		case 'a':
+			arena_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			opts.min_order = atoi(optarg);
+			break;
+		case 'f':
+			opts.flags = strtoul(optarg, NULL, 0);
+			break;
+		case 'z':
+			p.fixed_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			p.min_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			p.max_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			p.live = atoi(optarg);
+			break;
+		case 'r':
+			p.rounds = atoi(optarg);
+			break;
+		case 'c':
+			p.churn_ops = atol(optarg);
+			break;
+		default:
+			print_usage(argv[0], stderr);
+			return EXIT_FAILURE;
+		}
+	}
+	if (p.live <= 0 || p.min_size == 0 || p.min_size > p.max_size) {
+		print_usage(argv[0], stderr);
+		return EXIT_FAILURE;
+	}
+
+	printf("%-18s %-7s %9s %7s %7s %7s %8s %8s %7s\n", "workload", "alloc",
+	       "ns/op", "p50", "p99", "p999", "int-frag", "ext-frag", "fails");
+
+	for (int dist = DIST_FIXED; dist <= DIST_POWERLAW; ++dist) {
+		for (int pattern = PATTERN_LIFO; pattern <= PATTERN_CHURN; ++pattern) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "%s/%s", dist_names[dist], pattern_names[pattern]);
+			for (size_t i = 0; i < NUM_ALLOCATORS; ++i) {
+				result_t res;
+
+				/* a fresh arena per run so one workload cannot fragment the next */
+				arena = buddy_arena_create_opts(NULL, arena_size, &opts);
+				if (arena == NULL) {
+					fprintf(stderr, "ERROR: Failed to create a %zu byte arena\n", arena_size);
+					return EXIT_FAILURE;
+				}
+				if (run(&allocators[i], dist, pattern, &p, &res) != 0)
+					return EXIT_FAILURE;
+				buddy_arena_destroy(arena);
+
+				printf("%-18s %-7s %9.1f %7u %7u %7u %7.1f%% ", name, allocators[i].name,
+				       res.ns_per_op, res.p50, res.p99, res.p999, res.int_frag * 100);
+				if (res.ext_frag < 0)
+					printf("%8s ", "-");
+				else
+					printf("%7.1f%% ", res.ext_frag * 100);
+				printf("%7ld\n", res.fails);
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,292 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buddy.h"
+
+/**
+ * Contention benchmark: N threads hammer one arena with small alloc/free
+ * pairs: through a single global mutex around a plain arena, through a
+ * BUDDY_ARENA_THREADSAFE arena with per-thread magazines, through a
+ * BUDDY_ARENA_LOCKFREE arena with shared lock-free stacks and through
+ * per-CPU shards of magazine arenas.
+ *
+ * The magazine and sharded arenas are then run in producer/consumer pairs:
+ * one thread allocates and hands every block over a queue to a second one
+ * that frees it, so each block is freed by a thread (and, with shards,
+ * usually a CPU) other than the one that allocated it.
+ */
+
+#define ARENA_SIZE (1ul << 30) ///< bytes managed by each benchmark arena
+#define LIVE_SLOTS 64           ///< live blocks each thread keeps around
+#define QUEUE_SLOTS 256         ///< blocks in flight from a producer to its consumer
+
+/**
+ * How the arena is shared between the threads
+ */
+typedef enum share_mode_t {
+	MODE_MUTEX,
+	MODE_MAGAZINE,
+	MODE_LOCKFREE,
+	MODE_SHARDED
+} share_mode_t;
+
+static const char* mode_names[] = { "mutex", "magazine", "lockfree", "sharded" };
+static const unsigned int mode_flags[] = { 0, BUDDY_ARENA_THREADSAFE, BUDDY_ARENA_LOCKFREE,
+					   BUDDY_ARENA_THREADSAFE };
+
+/**
+ * Single-producer single-consumer queue of blocks
+ */
+typedef struct queue_t {
+	_Alignas(64) atomic_size_t head; ///< next slot the producer fills
+	_Alignas(64) atomic_size_t tail; ///< next slot the consumer empties
+	void* slots[QUEUE_SLOTS];
+} queue_t;
+
+/**
+ * Arguments of one worker thread
+ */
+typedef struct worker_t {
+	pthread_t thread;
+	buddy_arena_t* arena;
+	buddy_shards_t* shards; ///< MODE_SHARDED, used instead of arena
+	queue_t* queue;         ///< producer/consumer pairs: queue shared with the peer
+	share_mode_t mode;
+	long ops;
+	unsigned int seed;
+} worker_t;
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Monotonic clock in seconds
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void* worker_alloc(worker_t* w, size_t size)
+{
+	return w->shards != NULL ? buddy_shards_alloc(w->shards, size) :
+				   buddy_arena_alloc(w->arena, size);
+}
+
+static inline void worker_free(worker_t* w, void* addr)
+{
+	if (w->shards != NULL)
+		buddy_shards_free(w->shards, addr);
+	else
+		buddy_arena_free(w->arena, addr);
+}
+
+/**
+ * Worker loop: replace a random live slot on every iteration
+ *
+ * @param arg The worker_t of this thread
+ */
+static void* worker(void* arg)
+{
+	worker_t* w = arg;
+	void* live[LIVE_SLOTS] = { NULL };
+	bool locked = (w->mode == MODE_MUTEX);
+
+	for (long i = 0; i < w->ops; ++i) {
+		int slot = rand_r(&w->seed) % LIVE_SLOTS;
+
+		if (locked)
+			pthread_mutex_lock(&global_lock);
+
+		if (live[slot] != NULL) {
+			worker_free(w, live[slot]);
+			live[slot] = NULL;
+		}
+		else {
+			// 1 to 16 KiB, i.e. the magazine orders of a 4 KiB page arena
+			size_t size = 1024 + rand_r(&w->seed) % (16 * 1024 - 1024);
+			live[slot] = worker_alloc(w, size);
+		}
+
+		if (locked)
+			pthread_mutex_unlock(&global_lock);
+	}
+
+	for (int slot = 0; slot < LIVE_SLOTS; ++slot) {
+		if (locked)
+			pthread_mutex_lock(&global_lock);
+		worker_free(w, live[slot]);
+		if (locked)
+			pthread_mutex_unlock(&global_lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * Producer loop: allocate blocks and queue them for the consumer
+ *
+ * @param arg The worker_t of this thread
+ */
+static void* producer(void* arg)
+{
+	worker_t* w = arg;
+	queue_t* q = w->queue;
+
+	for (long i = 0; i < w->ops; ++i) {
+		size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+		size_t size = 1024 + rand_r(&w->seed) % (16 * 1024 - 1024);
+		void* addr = worker_alloc(w, size);
+
+		while (head - atomic_load_explicit(&q->tail, memory_order_acquire) == QUEUE_SLOTS)
+			sched_yield();
+		q->slots[head % QUEUE_SLOTS] = addr;
+		atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	}
+
+	return NULL;
+}
+
+/**
+ * Consumer loop: free the blocks the producer queues
+ *
+ * @param arg The worker_t of this thread
+ */
+static void* consumer(void* arg)
+{
+	worker_t* w = arg;
+	queue_t* q = w->queue;
+
+	for (long i = 0; i < w->ops; ++i) {
+		size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+		while (atomic_load_explicit(&q->head, memory_order_acquire) == tail)
+			sched_yield();
+		worker_free(w, q->slots[tail % QUEUE_SLOTS]);
+		atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	}
+
+	return NULL;
+}
+
+/**
+ * Run one configuration and print its throughput
+ *
+ * @param mode Sharing mode
+ * @param threads Number of worker threads
+ * @param ops Operations per thread
+ * @param paired Run the threads as producer/consumer pairs
+ */
+static int run(share_mode_t mode, int threads, long ops, bool paired)
+{
+	struct buddy_arena_opts opts = {
+		.min_order = 12,
+		.flags = mode_flags[mode],
+	};
+	buddy_arena_t* arena = NULL;
+	buddy_shards_t* shards = NULL;
+	worker_t* workers = calloc(threads, sizeof(worker_t));
+	queue_t* queues = paired ? aligned_alloc(64, threads / 2 * sizeof(queue_t)) : NULL;
+
+	if (mode == MODE_SHARDED)
+		shards = buddy_shards_create(ARENA_SIZE, 0, &opts);
+	else
+		arena = buddy_arena_create_opts(NULL, ARENA_SIZE, &opts);
+
+	if ((arena == NULL && shards == NULL) || workers == NULL || (paired && queues == NULL)) {
+		fprintf(stderr, "ERROR: Failed to set up the arena\n");
+		return -1;
+	}
+
+	double start = now();
+
+	for (int i = 0; i < threads; ++i) {
+		workers[i].arena = arena;
+		workers[i].shards = shards;
+		workers[i].mode = mode;
+		workers[i].ops = ops;
+		workers[i].seed = i + 1;
+		if (!paired) {
+			pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+			continue;
+		}
+		workers[i].queue = &queues[i / 2];
+		if (i % 2 == 0) {
+			atomic_init(&queues[i / 2].head, 0);
+			atomic_init(&queues[i / 2].tail, 0);
+		}
+		pthread_create(&workers[i].thread, NULL, i % 2 == 0 ? producer : consumer, &workers[i]);
+	}
+	for (int i = 0; i < threads; ++i)
+		pthread_join(workers[i].thread, NULL);
+
+	double elapsed = now() - start;
+
+	printf("%-8s %3d threads %10.2f Mops/s %8.1f ns/op%s\n",
+	       mode_names[mode], threads,
+	       threads * ops / elapsed / 1e6, elapsed * 1e9 / (threads * ops),
+	       paired ? "  producer/consumer" : "");
+
+	free(workers);
+	free(queues);
+	buddy_arena_destroy(arena);
+	buddy_shards_destroy(shards);
+	return 0;
+}
+
+/**
+ * Output program manual
+ *
+ * @param prog_name Name of the program passed in as a command line argument.
+ * @param out File stream to write to.
+ */
+static void print_usage(char* prog_name, FILE* out)
+{
+	fprintf(out, "Usage:\n");
+	fprintf(out, "  %s [-t threads] [-n ops]\n", prog_name);
+	fprintf(out, "     -t [optional] - Largest thread count, doubled from 1 (default 8);\n");
+	fprintf(out, "                     producer/consumer runs start from 2.\n");
+	fprintf(out, "     -n [optional] - Operations per thread (default 1000000).\n");
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	int max_threads = 8;
+	long ops = 1000000;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			ops = atol(optarg);
+			break;
+		default:
+			print_usage(argv[0], stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (int mode = MODE_MUTEX; mode <= MODE_SHARDED; ++mode)
+		for (int threads = 1; threads <= max_threads; threads *= 2)
+			if (run(mode, threads, ops, false) != 0)
+				return EXIT_FAILURE;
+
+	share_mode_t paired_modes[] = { MODE_MAGAZINE, MODE_SHARDED };
+	for (int i = 0; i < 2; ++i)
+		for (int threads = 2; threads <= max_threads; threads *= 2)
+			if (run(paired_modes[i], threads, ops, true) != 0)
+				return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -15,30 +15,77 @@
 /**************************************************************************
  * Included Files
  **************************************************************************/
+#define _GNU_SOURCE /* sched_getcpu() */
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "buddy.h"
 #include "list.h"
 
-#include "math.h"
-
 /**************************************************************************
  * Public Definitions
  **************************************************************************/
+/* geometry of the default arena used by buddy_init()/buddy_alloc() */
 #define MIN_ORDER 12
 #define MAX_ORDER 20
 
-#define PAGE_SIZE (1<<MIN_ORDER)
+/* blocks a remote-free queue drain hands to buddy_arena_free_bulk() at once */
+#define BUDDY_REMOTE_BATCH 64
+
+/* free_area[] slots per arena; orders are limited to BUDDY_ORDERS - 1 */
+#define BUDDY_ORDERS 64
+
+/* orders from min_order up served by per-thread magazines */
+#define BUDDY_MAG_ORDERS 4
+/* blocks one magazine holds; refills and drains move half of that */
+#define BUDDY_MAG_SIZE 32
+
+/* orders from min_order up with a lock-free stack in BUDDY_ARENA_LOCKFREE */
+#define BUDDY_LF_ORDERS 8
+/* blocks a lock-free stack holds before frees go to the free lists */
+#define BUDDY_LF_DEPTH 64
+/* blocks moved from the free lists onto an empty stack per refill */
+#define BUDDY_LF_BATCH 16
+
+/* orders from min_order up with a pending list in BUDDY_ARENA_LAZY */
+#define BUDDY_LAZY_ORDERS 8
+/* default high watermark of the min_order pending list, halved per order */
+#define BUDDY_LAZY_HIGH 64
+
+/* slab size classes are 16 B << i for i < BUDDY_SLAB_CLASSES */
+#define BUDDY_SLAB_CLASSES 8
+#define BUDDY_SLAB_MIN_SHIFT 4
+#define BUDDY_SLAB_MAX ((size_t)1 << (BUDDY_SLAB_MIN_SHIFT + BUDDY_SLAB_CLASSES - 1))
+/* a slab block is made large enough for at least this many objects */
+#define BUDDY_SLAB_MIN_OBJS 8
+/* and holds at most this many, the size of its free bitmap */
+#define BUDDY_SLAB_MAX_OBJS 256
+/* objects start this far into the slab block, after the slab_t header */
+#define BUDDY_SLAB_HEADER 64
+/* bytes of slab block per object: the object and its slack slot */
+#define BUDDY_SLAB_OBJ_BYTES(objsize) ((objsize) + sizeof(uint16_t))
+
+/* lock-free stack head: ABA tag in the upper half, page index + 1 below */
+#define LF_INDEX_MASK 0xffffffffull
+#define LF_TAG_ONE (1ull << 32)
+
+#define PAGE_SIZE(a) ((size_t)1 << (a)->min_order)
 /* page index to address */
-#define PAGE_TO_ADDR(page_idx) (void *)((page_idx*PAGE_SIZE) + g_memory)
+#define PAGE_TO_ADDR(a, page_idx) (void *)((a)->base + ((size_t)(page_idx) << (a)->min_order))
 
 /* address to page index */
-#define ADDR_TO_PAGE(addr) ((unsigned long)((void *)addr - (void *)g_memory) / PAGE_SIZE)
+#define ADDR_TO_PAGE(a, addr) ((size_t)((char *)(addr) - (a)->base) >> (a)->min_order)
 
 /* find buddy address */
-#define BUDDY_ADDR(addr, o) (void *)((((unsigned long)addr - (unsigned long)g_memory) ^ (1<<o)) \
-    + (unsigned long)g_memory)
+#define BUDDY_ADDR(a, addr, o) (void *)((((char *)(addr) - (a)->base) ^ ((size_t)1 << (o))) \
+    + (a)->base)
 
 #if USE_DEBUG == 1
 #  define PDEBUG(fmt, ...) \
@@ -54,321 +101,2692 @@
  * Public Types
  **************************************************************************/
 
+/**
+ * Per-page metadata, one byte per page. The upper two bits hold the state
+ * and the lower six an order. Only the first page of a block (its head) is
+ * meaningful, except in slab blocks where every page is marked. An exact
+ * allocation is a run of adjacent allocated blocks whose heads, apart from
+ * the last, are marked PAGE_CONT. An all-zero
+ * byte reads as "allocated", which is never mistaken for a free buddy.
+ *
+ * Free blocks are linked into free_area[] through a struct list_head stored
+ * in the first bytes of the block itself.
+ */
+typedef uint8_t page_t;
+
+#define PAGE_ALLOC 0x00 ///< head of an allocated block
+#define PAGE_FREE  0x40 ///< head of a block on free_area[order]
+#define PAGE_SLAB  0x80 ///< any page of a slab block of the given order
+#define PAGE_CONT  0xc0 ///< head of an allocated block continued by the next one
+#define PAGE_STATE_MASK 0xc0
+#define PAGE_ORDER_MASK 0x3f
+
+#define PAGE_STATE(p) ((p) & PAGE_STATE_MASK)
+#define PAGE_ORDER(p) ((p) & PAGE_ORDER_MASK)
+
+/* smallest page that can hold the free list links */
+#define BUDDY_MIN_PAGE_ORDER 4
+
+/**
+ * Per-thread cache of free blocks of a single order
+ */
+typedef struct {
+
+  int count;
+  void *blocks[BUDDY_MAG_SIZE];
+
+} magazine_t;
+
+/**
+ * Allocation counters, kept per arena and, in thread-safe arenas, per thread
+ * so the unlocked paths can count without contention. They are atomics so
+ * buddy_arena_stats() can read other threads' counters while they are being
+ * updated, but only the shared arena counters pay for a read-modify-write.
+ *
+ * The live byte counts go down when a block is freed, possibly by another
+ * thread than the one that allocated it, so a single thread's figures may
+ * wrap around; only their sum over all threads is meaningful.
+ */
+typedef struct {
+
+  atomic_ullong allocs;
+  atomic_ullong frees;
+  atomic_ullong total_requested;
+  atomic_ullong total_allocated;
+  atomic_ullong requested;
+  atomic_ullong allocated;
+
+} counters_t;
+
+/**
+ * Magazines of one thread for one thread-safe arena
+ */
+typedef struct {
+
+  /* on the arena's tcaches list */
+  struct list_head list;
+
+  buddy_arena_t *arena;
+
+  magazine_t mags[BUDDY_MAG_ORDERS];
+
+  counters_t ctr;
+
+} tcache_t;
+
+/**
+ * Lock-free (Treiber) stack of allocated-but-unused blocks of one order.
+ * The link to the next block is kept in the first word of each block.
+ */
+typedef struct {
+
+  _Atomic unsigned long long head;
+  atomic_int count;
+
+} lfstack_t;
+
+/**
+ * Header at the start of a slab block, which is carved into objects of one
+ * size class. The objects follow the header, and after them comes an array
+ * with the slack of each object for the statistics.
+ */
 typedef struct {
 
+  /* on the arena's slabs list of the class while it has free objects */
   struct list_head list;
 
-  void* address;
+  unsigned short cls;
+  unsigned short nobjs;
+  unsigned short nfree;
+
+  /* bit i is set while object i is free */
+  unsigned long long bitmap[BUDDY_SLAB_MAX_OBJS / 64];
+
+} slab_t;
+
+_Static_assert(sizeof(slab_t) <= BUDDY_SLAB_HEADER, "slab_t must fit BUDDY_SLAB_HEADER");
+
+/**
+ * One independently managed heap. Pages are (1 << min_order) bytes and the
+ * region, any whole number of pages, starts out as the largest aligned
+ * blocks of at most order max_order that tile it.
+ */
+struct buddy_arena {
+
+  /* managed region */
+  char *base;
+  size_t size;
+
+  int min_order;
+  int max_order;
+
+  /* page metadata, one byte per page of the region */
+  page_t *pages;
+  size_t n_pages;
+
+  /* bytes of the head block of each allocation beyond what was requested,
+   * at the index of its first page; slab objects keep theirs in the slab */
+  uint32_t *slack;
+
+  /* free lists, only [min_order, max_order] are used */
+  struct list_head free_area[BUDDY_ORDERS];
+
+  /* BUDDY_ARENA_TREE: used instead of the free lists, NULL otherwise. A
+   * complete binary tree in an array, root first, with a node per block of
+   * every order; each holds the largest order of a free block in its
+   * subtree, or 0 if there is none. Below an allocated or a whole free
+   * block the nodes are stale. The root covers 1 << tree_order bytes, the
+   * region rounded up to a power of two; the part past its end is never
+   * free. */
+  uint8_t *tree;
+  int tree_order;
+
+  /* blocks on free_area[o], kept in step with the lists */
+  size_t free_count[BUDDY_ORDERS];
+
+  /* bit o is set while free_area[o] is non-empty */
+  unsigned long long free_mask;
+
+  /* statistics; splits, merges and bytes_free change with the free lists */
+  counters_t ctr;
+  unsigned long long splits;
+  unsigned long long merges;
+  size_t bytes_free;
+  atomic_ullong failed[BUDDY_ORDERS];
+
+  /* BUDDY_ARENA_* flags the arena was created with */
+  unsigned int flags;
+
+  /* free blocks of at least this order are handed back to the OS */
+  int decommit_order;
+
+  /* mapping reserved by the arena itself, NULL for caller memory */
+  void *map_base;
+  size_t map_size;
+
+  /* BUDDY_ARENA_THREADSAFE: lock over the free lists and the calling
+   * thread's tcache_t */
+  pthread_mutex_t lock;
+  pthread_key_t tcache_key;
+
+  /* every live tcache_t of this arena */
+  struct list_head tcaches;
+
+  /* BUDDY_ARENA_LOCKFREE: stacks for orders min_order + i */
+  lfstack_t lfstacks[BUDDY_LF_ORDERS];
+
+  /* BUDDY_ARENA_SLAB: slabs with free objects, per size class */
+  struct list_head slabs[BUDDY_SLAB_CLASSES];
+
+  /* BUDDY_ARENA_LAZY: freed blocks of orders min_order + i that have not
+   * been coalesced yet, newest first; bit i of pending_mask is set while
+   * pending[i] is non-empty */
+  struct list_head pending[BUDDY_LAZY_ORDERS];
+  size_t pending_count[BUDDY_LAZY_ORDERS];
+  size_t pending_high[BUDDY_LAZY_ORDERS];
+  unsigned int pending_mask;
+
+};
+
+/**
+ * One shard of a buddy_shards_t, on its own cache line
+ */
+typedef struct shard_t {
+  buddy_arena_t *arena;
+
+  /* blocks freed from other CPUs, linked through their first word; pushed
+   * lock-free by any thread and taken whole by the shard's next allocation */
+  _Atomic(void *) remote;
+} __attribute__((aligned(64))) shard_t;
+
+/**
+ * Thread-safe arenas carved from one mapping, one per CPU. Shard i manages
+ * [base + i * stride, base + i * stride + shard_size); stride rounds the
+ * shard size up to its largest block so every shard stays aligned.
+ */
+struct buddy_shards {
+  char *base;
+  size_t stride;
 
-  int inuse;
-  int index;
-  int split;
+  /* arenas created so far, and entries of shards[] */
+  int n_shards;
+  int n_slots;
 
-  int inUseOrder;
+  /* the mapping holding every shard */
+  void *map_base;
+  size_t map_size;
 
-} page_t;
+  /* allocations served by a shard other than the calling CPU's */
+  atomic_ulong steals;
+
+  shard_t shards[];
+};
 
 /**************************************************************************
  * Global Variables
  **************************************************************************/
 
-/* free lists*/
-//21
-struct list_head free_area[MAX_ORDER+1];
+/* memory area of the default arena */
+static char g_memory[1<<MAX_ORDER];
 
-/* memory area */
-//2^20 = 1048576
-char g_memory[1<<MAX_ORDER];
+/* page metadata of the default arena */
+static page_t g_pages[(1<<MAX_ORDER)/(1<<MIN_ORDER)];
 
-/* page structures */
-// [256]
-page_t g_pages[(1<<MAX_ORDER)/PAGE_SIZE];
+/* allocation slack of the default arena */
+static uint32_t g_slack[(1<<MAX_ORDER)/(1<<MIN_ORDER)];
 
-/**************************************************************************
- * Public Function Prototypes
- **************************************************************************/
+/* block tree of the default arena with BUDDY_ARENA_TREE */
+static uint8_t g_tree[2*(1<<MAX_ORDER)/(1<<MIN_ORDER)];
+
+/* g_pages and g_tree have been written since the program started */
+static int g_meta_used;
 
+/* arena behind buddy_init/buddy_alloc/buddy_free/buddy_dump */
+static buddy_arena_t default_arena;
 
 /**************************************************************************
  * Local Functions
  **************************************************************************/
 
-static void *buddy_base_address = 0;
+/**
+ * Metadata of the page addr lies in
+ */
+static inline page_t *page_of(const buddy_arena_t *arena, const void *addr){
+  return &arena -> pages[ADDR_TO_PAGE(arena, addr)];
+}
 
+/**
+ * Count a free block of the given order
+ */
+static inline void free_count_add(buddy_arena_t *arena, int order){
+  arena -> free_count[order]++;
+  arena -> free_mask |= 1ull << order;
+  arena -> bytes_free += (size_t)1 << order;
+}
 
 /**
- * Initialize the buddy system
+ * Stop counting a free block of the given order
  */
-void buddy_init(){
+static inline void free_count_del(buddy_arena_t *arena, int order){
+  arena -> bytes_free -= (size_t)1 << order;
+  if(--arena -> free_count[order] == 0){
+    arena -> free_mask &= ~(1ull << order);
+  }
+}
 
-  int i;
+/**
+ * Tree node of the block of the given order at addr
+ */
+static inline size_t tree_node(const buddy_arena_t *arena, const void *addr, int order){
+  return (((size_t)1 << (arena -> tree_order - order)) - 1) +
+    ((size_t)((const char *)addr - arena -> base) >> order);
+}
 
-  //n_pages = 256
-  int n_pages = (1<<MAX_ORDER) / PAGE_SIZE;
+/**
+ * Set a tree node and bring its ancestors up to date, stopping at the first
+ * one that does not change.
+ *
+ * @param carved the node lies in an allocated block that is being carved
+ * up, where an ancestor may hold a stale value that merely looks unchanged,
+ * so every ancestor is recomputed
+ */
+static inline void tree_set(buddy_arena_t *arena, size_t node, uint8_t value,
+    int carved){
+  uint8_t *tree = arena -> tree;
+
+  tree[node] = value;
+  while(node > 0){
+    node = (node - 1) / 2;
+    uint8_t l = tree[2 * node + 1];
+    uint8_t r = tree[2 * node + 2];
+    value = l > r ? l : r;
+    if(tree[node] == value && !carved){
+      break;
+    }
+    tree[node] = value;
+  }
+}
 
-  buddy_base_address = &g_pages[0];
+/**
+ * Mark count adjacent blocks of the given order at addr, carved out of one
+ * allocated block, as allocated in the tree, together with every node above
+ * them up to the first that covers them all. The nodes above the pieces
+ * must be valid before the free pieces around them are added, or a later
+ * free would read a stale sibling. Does nothing for free lists.
+ */
+static void tree_clear(buddy_arena_t *arena, char *addr, int order, size_t count){
+  size_t first;
 
-  //for(0 < 256)
-  for (i = 0; i < n_pages; i++) {
-    g_pages[i].inuse = 0;
-    // Correct? Seems to output an address if I printf here
-    g_pages[i].address = PAGE_TO_ADDR(i);
-    g_pages[i].index = i;
-    g_pages[i].split = 0;
-    g_pages[i].inUseOrder = 0;
+  if(arena -> tree == NULL){
+    return;
+  }
+  first = tree_node(arena, addr, order);
+  for (;;) {
+    memset(&arena -> tree[first], 0, count);
+    if(count == 1){
+      break;
+    }
+    first = (first - 1) / 2;
+    count = (count + 1) / 2;
+  }
+}
 
-    //printf("Inuse:[%i]\n", g_pages[i].inuse);
-    //printf("Address:[%i]\n", g_pages[i].address);
-    //printf("Index:[%i]\n", g_pages[i].index);
-    //printf("\n");
+/**
+ * Put the free block at addr on the free list (or in the tree) of the given
+ * order
+ */
+static inline void free_area_add(buddy_arena_t *arena, void *addr, int order){
+  *page_of(arena, addr) = PAGE_FREE | order;
+  if(arena -> tree != NULL){
+    tree_set(arena, tree_node(arena, addr, order), order, 1);
   }
+  else{
+    list_add((struct list_head *)addr, &arena -> free_area[order]);
+  }
+  free_count_add(arena, order);
+}
 
+/**
+ * Take the free block at addr off its free list (or out of the tree). Its
+ * head is left marked allocated.
+ */
+static inline void free_area_del(buddy_arena_t *arena, void *addr){
+  page_t *page = page_of(arena, addr);
+  int order = PAGE_ORDER(*page);
 
-  /* initialize freelist */
-  //for(12 < = 20)
-  for (i = MIN_ORDER; i <= MAX_ORDER; i++) {
-    /*INIT_LIST_HEAD(ptr) do { (ptr)->next = (ptr); (ptr)->prev = (ptr); } while (0) 
-      this sets free_area[i]'s linked list head pointers next and prev to both point at the head*/
-    INIT_LIST_HEAD(&free_area[i]);
+  if(arena -> tree != NULL){
+    tree_set(arena, tree_node(arena, addr, order), 0, 0);
+  }
+  else{
+    list_del((struct list_head *)addr);
   }
+  *page = PAGE_ALLOC | order;
+  free_count_del(arena, order);
+}
+
+/**
+ * Map zeroed memory for allocator metadata. Metadata never comes from
+ * malloc() so the allocator can stand in for malloc() itself.
+ *
+ * @return the memory, or NULL if out of memory
+ */
+static void *meta_alloc(size_t size){
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return mem == MAP_FAILED ? NULL : mem;
+}
 
-  /* add the entire memory as a freeblock */
-  list_add(&g_pages[0].list, &free_area[MAX_ORDER]);
+/**
+ * Unmap metadata from meta_alloc()
+ */
+static void meta_free(void *mem, size_t size){
+  if(mem != NULL){
+    munmap(mem, size);
+  }
 }
 
-unsigned int next_power2(unsigned int size){
-  //printf("next_power2(unsigned int size) = %i \n" , size);
-  if (size < (1 << MIN_ORDER)) {
-    return (1 << MIN_ORDER);
+/**
+ * Smallest order whose block holds size bytes, never below min_order
+ */
+static inline int size_to_order(const buddy_arena_t *arena, size_t size){
+  if (size <= PAGE_SIZE(arena)) {
+    return arena -> min_order;
   }
+  return 64 - __builtin_clzll(size - 1);
+}
 
-  size--;
-  // bitwise or AND equal bitshift
-  // Increases size until condition satisfies
-  size |= size >> 1;
-  size |= size >> 2;
-  size |= size >> 4;
-  size |= size >> 8;
-  size |= size >> 16;
-  size++;
+/**
+ * Smallest order whose block holds size bytes, at least 1
+ */
+static inline int ceil_order(size_t size){
+  return size <= 2 ? 1 : 64 - __builtin_clzll(size - 1);
+}
 
-  return size;
+/**
+ * Bytes of block tree for an arena of size bytes
+ */
+static inline size_t tree_bytes(size_t size, int min_order){
+  return (size_t)2 << (ceil_order(size) - min_order);
 }
 
 /**
- * Allocate a memory block.
+ * Lay out an arena over base, using pages (one byte per page) as its page
+ * metadata and tree (tree_bytes()), if not NULL, as its block tree, and
+ * put the whole region on the free lists.
  *
- * On a memory request, the allocator returns the head of a free-list of the
- * matching size (i.e., smallest block that satisfies the request). If the
- * free-list of the matching block size is empty, then a larger block size will
- * be selected. The selected (large) block is then splitted into two smaller
- * blocks. Among the two blocks, left block will be used for allocation or be
- * further splitted while the right block will be added to the appropriate
- * free-list.
+ * An all-zero page byte is PAGE_ALLOC of order 0, which is what every page
+ * that does not start a free block must hold, and an all-zero tree has
+ * nothing free, so metadata that is known to be zero (fresh anonymous
+ * mappings, untouched static arrays) is used as is. Creation then only
+ * writes the heads of the initial blocks and costs O(top-level blocks)
+ * rather than O(pages): the kernel hands out the zero pages as the
+ * metadata is first touched.
  *
- * @param size size in bytes
- * @return memory block address
+ * The region is tiled with the largest blocks that are aligned to their
+ * own size, capped at max_order: a 48 GiB arena with max_order 32 starts
+ * as twelve 4 GiB blocks, a 5 MiB one with max_order 20 as five 1 MiB
+ * blocks, and a 3 MiB one with max_order 21 as one 2 MiB and one 1 MiB
+ * block.
  */
-void *buddy_alloc(int size){
-
-  if(PRINT){printf("ADDING BLOCK size is currently [%i] \n", size);}
-
-  int blocksize = next_power2(size);
-  unsigned int blockorder = 0 ;
-  while( blocksize>>=1 ) blockorder++;
+static void arena_init(buddy_arena_t *arena, void *base, size_t size,
+    int min_order, int max_order, page_t *pages, uint32_t *slack, uint8_t *tree,
+    int zeroed){
+
+  size_t offset;
+  int o;
+
+  arena -> base = base;
+  arena -> size = size;
+  arena -> min_order = min_order;
+  arena -> max_order = max_order;
+  arena -> pages = pages;
+  arena -> slack = slack;
+  arena -> n_pages = size >> min_order;
+  arena -> tree = tree;
+  arena -> tree_order = ceil_order(size);
+  arena -> free_mask = 0;
+  memset(&arena -> ctr, 0, sizeof(arena -> ctr));
+  arena -> splits = 0;
+  arena -> merges = 0;
+  arena -> bytes_free = 0;
+  for (o = 0; o < BUDDY_ORDERS; o++) {
+    atomic_init(&arena -> failed[o], 0);
+  }
+  arena -> flags = 0;
+  arena -> decommit_order = BUDDY_ORDERS;
+  arena -> map_base = NULL;
+  arena -> map_size = 0;
+
+  if(!zeroed){
+    memset(pages, PAGE_ALLOC, arena -> n_pages * sizeof(page_t));
+    if(tree != NULL){
+      memset(tree, 0, tree_bytes(size, min_order));
+    }
+  }
 
-  //printf("next_power2 set blockorder = [%i] \n", blockorder);
-  if(blockorder > MAX_ORDER){
-    blockorder = MAX_ORDER;
+  /* initialize freelist */
+  for (o = min_order; o <= arena -> max_order; o++) {
+    INIT_LIST_HEAD(&arena -> free_area[o]);
+    arena -> free_count[o] = 0;
   }
-  else if(blockorder < MIN_ORDER){
-    blockorder = MIN_ORDER;
+  for (o = 0; o < BUDDY_LAZY_ORDERS; o++) {
+    INIT_LIST_HEAD(&arena -> pending[o]);
+    arena -> pending_count[o] = 0;
+    arena -> pending_high[o] = BUDDY_LAZY_HIGH >> o > 0 ? BUDDY_LAZY_HIGH >> o : 1;
   }
+  arena -> pending_mask = 0;
 
-  // Look across free_list for smallest size free block that's big enough.
-  // Starts at 'blockorder' because we don't want any size smaller than that.
-  int freeorder = blockorder;
-  //printf("blockorder is currently [%i] \n", blockorder);
-  // TODO maybe problems here if they ask for more memory than is available or
-  // more than the size of the memory. Will likely segfault if freeorder >
-  // MAX_ORDER
-  while(list_empty(&free_area[freeorder]) != 0){ //This returns zero when the list IS NOT empty
-    //printf("free_area order [%i] has no blocks allotted.\n", freeorder);
-    freeorder++;
+  /* add the entire memory as maximal aligned free blocks */
+  for (offset = 0; offset < size; offset += (size_t)1 << o) {
+    o = offset ? __builtin_ctzll(offset) : 63;
+    if(o > max_order){
+      o = max_order;
+    }
+    while(offset + ((size_t)1 << o) > size){
+      o--;
+    }
+    free_area_add(arena, arena -> base + offset, o);
   }
+}
 
-  // Stopgap helps, but doesn't catch memory in use segfault
-  if(freeorder > MAX_ORDER){
+/**
+ * Reserve size bytes of address space aligned to align, so that every
+ * block is aligned to its own size. Nothing is committed until first touch.
+ *
+ * @param size size of the region
+ * @param align alignment, the size of the largest block
+ * @param flags BUDDY_ARENA_* flags
+ * @param map_base set to the start of the mapping to munmap() later
+ * @param map_size set to the length of that mapping
+ * @return aligned region, or NULL on failure
+ */
+static void *arena_map(size_t size, size_t align, unsigned int flags,
+    void **map_base, size_t *map_size){
+
+  int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  char *mem = MAP_FAILED;
+  int hugetlb = 0;
+
+  /* over-reserve so the region can be aligned; hugetlb mappings are only
+   * huge page aligned, which is less than align for large arenas */
+#ifdef MAP_HUGETLB
+  if(flags & BUDDY_ARENA_HUGETLB){
+    /* fall back to normal pages when the pool is empty */
+    mem = mmap(NULL, size + align, PROT_READ | PROT_WRITE, mmap_flags | MAP_HUGETLB, -1, 0);
+    hugetlb = mem != MAP_FAILED;
+  }
+#endif
+  if(mem == MAP_FAILED){
+    mem = mmap(NULL, size + align, PROT_READ | PROT_WRITE, mmap_flags, -1, 0);
+  }
+  if(mem == MAP_FAILED){
     return NULL;
   }
 
-  // Split blocks until small enough
-  //printf("freeorder is currently [%i] \n", freeorder);
-  page_t* page;
-  page_t* front;
-
-  // If no agreement, remove element and remember it as 'front'. Add the
-  // second half onto the list of smaller order
-  if(freeorder > blockorder){
-    front = page = list_entry(free_area[freeorder].next, page_t, list);
-    list_del_init(free_area[freeorder].next);
-    freeorder--;
-    //printf("Front has index %d \n",front -> index);
-    //printf("Added index %d \n",page -> index + (1<<(freeorder))/PAGE_SIZE);
-    list_add_tail(&g_pages[ page -> index + (1<<(freeorder))/PAGE_SIZE ].list, &free_area[freeorder]);
-    if(PRINT){printf("Added page %d \n", front -> index + (1<<(freeorder))/PAGE_SIZE);}
+  /* trim to the aligned region; a hugetlb mapping only splits at huge page
+   * boundaries, so a trim the kernel refuses leaves that part mapped */
+  char *aligned = (char *)(((unsigned long)mem + align - 1) & ~(align - 1));
+  char *end = mem + size + align;
+  *map_base = mem;
+  if(aligned > mem && munmap(mem, aligned - mem) == 0){
+    *map_base = aligned;
   }
+  if(aligned + size < end && munmap(aligned + size, end - (aligned + size)) == 0){
+    end = aligned + size;
+  }
+  *map_size = end - (char *)*map_base;
 
-  // If still too big, keep adding the smaller block indices to order lists
-  // until small enough. The very last leftmost element gets returned instead
-  // of added.
-  while(freeorder > blockorder){
+#ifdef MADV_HUGEPAGE
+  if(!hugetlb && (flags & (BUDDY_ARENA_HUGEPAGE | BUDDY_ARENA_HUGETLB))){
+    madvise(aligned, size, MADV_HUGEPAGE);
+  }
+#endif
 
-    // Get frontmost item from free_area queue
-    page = list_entry(free_area[freeorder].next, page_t, list);
+  return aligned;
+}
 
-    //printf("Checked page order [%i] in use ? %d \n", freeorder, page -> inuse);
-    //printf("Checked page order [%i] has page index ? %d \n", freeorder, page -> index); 
+/**************************************************************************
+ * Block Tree Functions
+ **************************************************************************/
 
+/**
+ * Allocate a block of the given order from the tree.
+ *
+ * The walk starts at the root and at each level enters the child with the
+ * smallest largest-free-order that still fits the request (the left one on
+ * a tie), so requests are packed into the most fragmented subtree that can
+ * hold them. Whole free blocks on the way are split, which makes the stale
+ * nodes of their halves valid again. O(max_order - min_order) with no
+ * pointer chasing; the top levels of the tree share a few cache lines.
+ *
+ * @param arena arena to allocate from
+ * @param blockorder order of the block, at most max_order
+ * @return memory block address, or NULL if no block is large enough
+ */
+static void *tree_take(buddy_arena_t *arena, int blockorder){
+  uint8_t *tree = arena -> tree;
+  size_t node = 0;
+  size_t offset = 0;
+  int order = arena -> tree_order;
 
-    // now working in smaller order
-    freeorder--;
+  if(tree[0] < blockorder){
+    return NULL;
+  }
 
-    //   printf("Checked page order [%i] has buddy page index ? %d \n", freeorder, front -> index + (1<<(freeorder))/PAGE_SIZE);
-    g_pages[ front -> index + (1<<(freeorder))/PAGE_SIZE ].split = 1;
+  while(order > blockorder){
+    size_t l = 2 * node + 1;
+    size_t r = l + 1;
+
+    if(tree[node] == order){
+      char *block = arena -> base + offset;
+      tree[l] = tree[r] = order - 1;
+      *page_of(arena, block) = PAGE_FREE | (order - 1);
+      *page_of(arena, block + ((size_t)1 << (order - 1))) = PAGE_FREE | (order - 1);
+      free_count_del(arena, order);
+      free_count_add(arena, order - 1);
+      free_count_add(arena, order - 1);
+      arena -> splits++;
+    }
 
-    list_add_tail(&g_pages[ front -> index + (1<<(freeorder))/PAGE_SIZE ].list, &free_area[freeorder]);
-    if(PRINT){printf("Added page %d \n", front -> index + (1<<(freeorder))/PAGE_SIZE);}
+    order--;
+    if(tree[l] >= blockorder && (tree[r] < blockorder || tree[l] <= tree[r])){
+      node = l;
+    }
+    else{
+      node = r;
+      offset += (size_t)1 << order;
+    }
   }
 
-  front -> inuse = 1;
-  front -> split = 1;
-  front -> inUseOrder = blockorder;
+  char *front = arena -> base + offset;
+  tree_set(arena, node, 0, 0);
+  *page_of(arena, front) = PAGE_ALLOC | blockorder;
+  free_count_del(arena, blockorder);
+  return front;
+}
+
+/**
+ * Free an allocated block to the tree, merging it with its buddies while
+ * they are whole free blocks: a buddy is one exactly when its sibling node
+ * holds its order. Only the node of the merged block and its ancestors are
+ * written.
+ *
+ * @param arena arena the block was allocated from
+ * @param addr memory block address to be freed
+ */
+static void tree_coalesce(buddy_arena_t *arena, void *addr){
+  char *block = addr;
+  int order = PAGE_ORDER(*page_of(arena, block));
+  size_t node = tree_node(arena, block, order);
+
+  while(order < arena -> max_order){
+    size_t sibling = node & 1 ? node + 1 : node - 1;
+    if(arena -> tree[sibling] != order){
+      break;
+    }
 
-  //printf("Returning page address [%i] with pageindex %d \n", &free_area[blockorder].next, front -> index); 
+    char *buddy = BUDDY_ADDR(arena, block, order);
+    free_count_del(arena, order);
+    arena -> merges++;
+    if(buddy < block){
+      *page_of(arena, block) = PAGE_ALLOC;
+      block = buddy;
+    }
+    else{
+      *page_of(arena, buddy) = PAGE_ALLOC;
+    }
+    node = (node - 1) / 2;
+    order++;
+  }
 
-  return front -> address;
+  if(order >= arena -> decommit_order){
+    madvise(block, (size_t)1 << order, MADV_DONTNEED);
+  }
 
+  *page_of(arena, block) = PAGE_FREE | order;
+  tree_set(arena, node, order, 0);
+  free_count_add(arena, order);
 }
 
-void coalesce(){
-  int temp_order = MIN_ORDER;
-  while(list_empty(&free_area[temp_order]) == 0 || temp_order < MAX_ORDER){
-    //while(1){
-    struct list_head *ptr;
-    page_t* page;
-    page_t* buddy;
-    //printf("While!\n");
-    // Go down each list and look for a free buddy
-    for (ptr = free_area[temp_order].next; ptr != &free_area[temp_order]; ptr = ptr->next) {
-      page = list_entry(ptr, page_t, list);
-      int buddyaddress = BUDDY_ADDR(page -> address, page -> inUseOrder);
-      int buddyindex = ADDR_TO_PAGE(buddyaddress);
-      buddy = &g_pages[buddyindex];
-      int lowerindex;
-      if(buddy -> index < page -> index){
-        lowerindex = buddy -> index;
-      }
-      else{
-        lowerindex = page -> index;
-      }
-      if(buddy -> inuse == 0 && page -> inUseOrder > 0){// && buddy -> inUseOrder == page -> inUseOrder  ){
-        printf("page inuseorder %d\n", page -> inUseOrder);
+/**************************************************************************
+ * Block Functions
+ **************************************************************************/
 
-        // THIS IS THE PART THAT DOESN'T WORK CORRECTLY
-        list_del( free_area[temp_order].next );
-        list_del( free_area[temp_order].next );
+/**
+ * Allocate a block of the given order from the free lists (or the tree).
+ *
+ * On a memory request, the allocator returns the head of a free-list of the
+ * matching size (i.e., smallest block that satisfies the request). If the
+ * free-list of the matching block size is empty, then a larger block size will
+ * be selected. The selected (large) block is then splitted into two smaller
+ * blocks. Among the two blocks, left block will be used for allocation or be
+ * further splitted while the right block will be added to the appropriate
+ * free-list.
+ *
+ * The caller holds the arena lock if the arena is shared.
+ *
+ * @param arena arena to allocate from
+ * @param blockorder order of the block, at most max_order
+ * @return memory block address, or NULL if no block is large enough
+ */
+static void *block_take(buddy_arena_t *arena, int blockorder){
 
-        buddy -> inUseOrder = 0;
-        page -> inUseOrder = 0;
+  if(arena -> tree != NULL){
+    return tree_take(arena, blockorder);
+  }
 
-        list_add( &g_pages[ lowerindex ].list, &free_area[temp_order+1]  );
+  // Smallest non-empty order that is big enough. An empty mask means no
+  // block large enough is left.
+  unsigned long long candidates = arena -> free_mask & ~((1ull << blockorder) - 1);
+  if(candidates == 0){
+    return NULL;
+  }
+  int freeorder = __builtin_ctzll(candidates);
 
+  // Take the first block of the chosen order off its free list
+  char *front = (char *)arena -> free_area[freeorder].next;
+  free_area_del(arena, front);
 
+  // Split until small enough. The left half is kept (and possibly split
+  // again) while the right half goes onto the free list one order down.
+  while(freeorder > blockorder){
+    freeorder--;
 
-      }
-      }
-      temp_order++;
+    char *buddy = front + ((size_t)1 << freeorder);
+    free_area_add(arena, buddy, freeorder);
+    arena -> splits++;
+    if(PRINT){printf("Added block %p \n", buddy);}
+  }
 
-    }
+  *page_of(arena, front) = PAGE_ALLOC | blockorder;
 
+  return front;
 
+}
 
+/**
+ * Free an allocated block to the free lists (or the tree).
+ *
+ * Whenever a block is freed, the allocator checks its buddy. If the buddy is
+ * free as well, then the two buddies are combined to form a bigger block. This
+ * process continues until one of the buddies is not free.
+ *
+ * The buddy of a block is found directly through BUDDY_ADDR()/ADDR_TO_PAGE(),
+ * and it is known to be free (and whole) when its head page is marked free
+ * at the same order. Each merge step is therefore constant time and a free costs
+ * at most max_order - min_order steps.
+ *
+ * Blocks that end up at decommit_order or above have their memory returned
+ * to the OS; it is committed again when the block is next touched.
+ *
+ * The caller holds the arena lock if the arena is shared.
+ *
+ * @param arena arena the block was allocated from
+ * @param addr memory block address to be freed
+ */
+static void block_coalesce(buddy_arena_t *arena, void *addr){
 
+  if(arena -> tree != NULL){
+    tree_coalesce(arena, addr);
+    return;
   }
 
+  char *block = addr;
+  int order = PAGE_ORDER(*page_of(arena, block));
 
-  /**
-   * Free an allocated memory block.
-   *
-   * Whenever a block is freed, the allocator checks its buddy. If the buddy is
-   * free as well, then the two buddies are combined to form a bigger block. This
-   * process continues until one of the buddies is not free.
-   *
-   * @param addr memory block address to be freed
-   */
-  void buddy_free(void *addr){
+  if(PRINT){printf("\nREMOVING addr %p with order %d \n", addr, order);}
 
-    int pageindex = ADDR_TO_PAGE(addr);
-    //int pageindex = ((page_t*)addr) -> index;
-    if(PRINT){printf("\nREMOVING addr %d with pageindex %d \n", addr, pageindex);}
+  while(order < arena -> max_order){
+    size_t merged = (size_t)(block - arena -> base) & ~(((size_t)2 << order) - 1);
+
+    // In an arena that is not a power of two the buddy may run past the end
+    if(merged + ((size_t)2 << order) > arena -> size){
+      break;
+    }
 
-    g_pages[pageindex].inuse = 0;
+    char *buddy = BUDDY_ADDR(arena, block, order);
+    page_t *buddypage = page_of(arena, buddy);
 
-    // Get the inUseOrder of the page at the address provided
-    int temp_order = g_pages[pageindex].inUseOrder;
-    if(PRINT){printf("remove block addr %d has inUseOrder %d \n", addr, temp_order);}
+    // Stop as soon as the buddy is allocated or split into smaller blocks
+    if(*buddypage != (PAGE_FREE | order)){
+      break;
+    }
+    if(PRINT){printf("MERGING BUDDY %p\n", buddy);}
 
-    page_t* page;
+    free_area_del(arena, buddy);
+    arena -> merges++;
 
+    // The merged block starts at the lower of the two buddies; the upper
+    // head is no longer a head at all
+    if(buddy < block){
+      *page_of(arena, block) = PAGE_ALLOC;
+      block = buddy;
+    }
+    else{
+      *buddypage = PAGE_ALLOC;
+    }
+    order++;
+  }
 
-    // THESE AREN'T QUITE WORKING BUT ARE A BETTER IMPLEMENTATION
-    //list_add(&g_pages[pageindex].list, &free_area[temp_order]);
+  // The links are written after MADV_DONTNEED, recommitting only one page
+  if(order >= arena -> decommit_order){
+    madvise(block, (size_t)1 << order, MADV_DONTNEED);
+  }
 
+  free_area_add(arena, block, order);
+}
 
+/**
+ * Coalesce the oldest blocks of pending list i until at most keep are left
+ */
+static void pending_drain(buddy_arena_t *arena, int i, size_t keep){
+  while(arena -> pending_count[i] > keep){
+    struct list_head *oldest = arena -> pending[i].prev;
+    list_del(oldest);
+    arena -> pending_count[i]--;
+    block_coalesce(arena, oldest);
+  }
+  if(arena -> pending_count[i] == 0){
+    arena -> pending_mask &= ~(1u << i);
+  }
+}
 
+/**
+ * Coalesce every pending block
+ *
+ * @return 1 if there were any
+ */
+static int pending_drain_all(buddy_arena_t *arena){
+  unsigned int mask = arena -> pending_mask;
 
-    while(list_empty(&free_area[temp_order]) == 0){ // && temp_order < MAX_ORDER){
-      struct list_head *ptr;
+  while(arena -> pending_mask != 0){
+    pending_drain(arena, __builtin_ctz(arena -> pending_mask), 0);
+  }
+  return mask != 0;
+}
 
-      // Go down each list and look for a free buddy
-      list_for_each(ptr, &free_area[temp_order]) {
-        page = list_entry(ptr, page_t, list);
-        if(PRINT){printf("Free block in list has address %d and looking for %d. Block has pageindex %d \n", page, BUDDY_ADDR(addr, temp_order), page -> index);}
+/**
+ * Allocate a block of the given order.
+ *
+ * In a BUDDY_ARENA_LAZY arena a pending block of exactly that order is
+ * reused first, without any split. If no block is large enough, the pending
+ * blocks are coalesced and the free lists tried again, so deferring merges
+ * never makes a request fail.
+ *
+ * The caller holds the arena lock if the arena is shared.
+ *
+ * @param arena arena to allocate from
+ * @param order order of the block, at most max_order
+ * @return memory block address, or NULL if no block is large enough
+ */
+static void *block_alloc(buddy_arena_t *arena, int order){
+  unsigned int i = order - arena -> min_order;
+
+  if(i < BUDDY_LAZY_ORDERS && (arena -> pending_mask & (1u << i))){
+    struct list_head *newest = arena -> pending[i].next;
+    list_del(newest);
+    if(--arena -> pending_count[i] == 0){
+      arena -> pending_mask &= ~(1u << i);
+    }
+    return newest;
+  }
 
-        if(page -> address == BUDDY_ADDR(addr, temp_order)){
-          if(PRINT){printf("MERGING BUDDY with page index %d\n", page -> index);}
+  void *addr = block_take(arena, order);
+  if(addr == NULL && pending_drain_all(arena)){
+    addr = block_take(arena, order);
+  }
+  return addr;
+}
 
-          // TODO Problems here. This is where it gets deleted from one list and
-          // added to the next one
-          list_del(&page -> list);
-          // Exit as soon as we have the page we want
-          break;
-        }
-      }
-      temp_order++;
+/**
+ * Free an allocated block.
+ *
+ * In a BUDDY_ARENA_LAZY arena small blocks are parked on the pending list
+ * of their order, still marked allocated, instead of being merged with
+ * their buddies. Only when a list grows past its high watermark are its
+ * oldest blocks coalesced, down to half the watermark, so steady churn of
+ * one size neither merges nor splits (like Linux's per-CPU page lists).
+ *
+ * The caller holds the arena lock if the arena is shared.
+ *
+ * @param arena arena the block was allocated from
+ * @param addr memory block address to be freed
+ */
+static void block_free(buddy_arena_t *arena, void *addr){
+  unsigned int i = PAGE_ORDER(*page_of(arena, addr)) - arena -> min_order;
 
-    }
-    list_add(&g_pages[pageindex].list, &free_area[temp_order]);   
+  if(!(arena -> flags & BUDDY_ARENA_LAZY) || i >= BUDDY_LAZY_ORDERS){
+    block_coalesce(arena, addr);
+    return;
+  }
 
-    coalesce();
+  list_add((struct list_head *)addr, &arena -> pending[i]);
+  arena -> pending_mask |= 1u << i;
+  if(++arena -> pending_count[i] > arena -> pending_high[i]){
+    pending_drain(arena, i, arena -> pending_high[i] / 2);
   }
+}
+
+/**
+ * Allocate up to count blocks of one order, splitting each larger block
+ * once and handing out as many of its pieces as are still needed. Pieces
+ * that are not needed go back to the free lists as the largest aligned
+ * blocks they form. Called with the arena lock held if the arena is shared.
+ *
+ * @param arena arena to allocate from
+ * @param order order of every block
+ * @param count number of blocks wanted
+ * @param out receives the block addresses
+ * @return number of blocks allocated, less than count if memory ran out
+ */
+static size_t block_alloc_bulk(buddy_arena_t *arena, int order, size_t count,
+    void **out){
 
+  size_t n = 0;
 
-    /**
-     * Print the buddy system status---order oriented
-     *
-     * print free pages in each order.
-     */
-    void buddy_dump(){
-      int o;
-      for (o = MIN_ORDER; o <= MAX_ORDER; o++) {
-        struct list_head *pos;
-        int cnt = 0;
-        list_for_each(pos, &free_area[o]) {
-          cnt++;
-        }
-        printf("%d:%dK ", cnt, (1<<o)/1024);
+  while(n < count){
+    unsigned long long candidates = arena -> free_mask & ~((1ull << order) - 1);
+    if(candidates == 0){
+      if(pending_drain_all(arena)){
+        continue;
       }
-      printf("\n");
+      break;
     }
+    int freeorder = __builtin_ctzll(candidates);
+    char *front = block_take(arena, freeorder);
+
+    size_t pieces = (size_t)1 << (freeorder - order);
+    size_t take = count - n < pieces ? count - n : pieces;
+    size_t i;
+
+    for (i = 0; i < take; i++) {
+      char *piece = front + (i << order);
+      *page_of(arena, piece) = PAGE_ALLOC | order;
+      out[n++] = piece;
+    }
+    tree_clear(arena, front, order, take);
+
+    // Pieces [take, pieces) are free; give them back as maximal blocks
+    while(i < pieces){
+      int k = __builtin_ctzll(i);
+      while(i + ((size_t)1 << k) > pieces){
+        k--;
+      }
+      free_area_add(arena, front + (i << order), order + k);
+      i += (size_t)1 << k;
+      arena -> splits++;
+    }
+    // take + remainder blocks came out of one block
+    arena -> splits += take - 1;
+  }
+  return n;
+}
+
+/**
+ * Shrink an allocated block in place by handing its upper halves back to the
+ * free lists. The halves cannot merge: their buddies are still allocated.
+ * Called with the arena lock held if the arena is shared.
+ *
+ * @param arena arena the block belongs to
+ * @param addr block address
+ * @param new_order order to shrink to, at most the current order
+ */
+static void block_shrink(buddy_arena_t *arena, void *addr, int new_order){
+  page_t *page = page_of(arena, addr);
+  int order = PAGE_ORDER(*page);
+
+  while(order > new_order){
+    order--;
+    tree_clear(arena, addr, order, 1);
+    free_area_add(arena, (char *)addr + ((size_t)1 << order), order);
+    arena -> splits++;
+  }
+  *page = PAGE_ALLOC | new_order;
+}
+
+/**
+ * Grow an allocated block in place by absorbing the free buddies to its
+ * right, one order at a time. Nothing is changed unless every buddy up to
+ * new_order is free. Called with the arena lock held if the arena is
+ * shared.
+ *
+ * @param arena arena the block belongs to
+ * @param addr block address
+ * @param new_order order to grow to, at most max_order
+ * @return 1 if the block now has order new_order, 0 otherwise
+ */
+static int block_grow(buddy_arena_t *arena, void *addr, int new_order){
+  page_t *page = page_of(arena, addr);
+  size_t offset = (char *)addr - arena -> base;
+  int order = PAGE_ORDER(*page);
+  int o;
+
+  // The block must be the left half at every level and each right hand
+  // buddy must be one whole free block
+  for (o = order; o < new_order; o++) {
+    char *buddy = (char *)addr + ((size_t)1 << o);
+    if((offset & ((size_t)1 << o)) != 0 || offset + ((size_t)2 << o) > arena -> size ||
+        *page_of(arena, buddy) != (PAGE_FREE | o)){
+      return 0;
+    }
+  }
+
+  for (o = order; o < new_order; o++) {
+    char *buddy = (char *)addr + ((size_t)1 << o);
+    free_area_del(arena, buddy);
+    *page_of(arena, buddy) = PAGE_ALLOC;
+    arena -> merges++;
+  }
+  *page = PAGE_ALLOC | new_order;
+  return 1;
+}
+
+/**
+ * Allocate exactly size bytes, rounded up to whole pages, as a run of
+ * adjacent blocks. A block of the next power of two is split and the pieces
+ * past the end of the request go straight back to the free lists (like
+ * Linux's alloc_pages_exact()). Called with the arena lock held if the
+ * arena is shared.
+ *
+ * @param arena arena to allocate from
+ * @param size size in bytes, a multiple of the page size
+ * @return address of the first block, or NULL if no block is large enough
+ */
+static void *block_alloc_exact(buddy_arena_t *arena, size_t size){
+  int order = size_to_order(arena, size);
+  char *addr = block_alloc(arena, order);
+  char *cur = addr;
+  size_t need = size;
+
+  if(addr == NULL){
+    return NULL;
+  }
+
+  // need is always a whole number of pages, so this ends on a single block
+  while(need < ((size_t)1 << order)){
+    order--;
+    arena -> splits++;
+    tree_clear(arena, cur, order, 1);
+    if(need <= ((size_t)1 << order)){
+      // Only the left half is needed
+      free_area_add(arena, cur + ((size_t)1 << order), order);
+    }
+    else{
+      // The left half is needed entirely, keep splitting the right one
+      *page_of(arena, cur) = PAGE_CONT | order;
+      cur += (size_t)1 << order;
+      need -= (size_t)1 << order;
+    }
+  }
+  *page_of(arena, cur) = PAGE_ALLOC | order;
+  return addr;
+}
+
+/**
+ * Free every block of an exact allocation. Called with the arena lock held
+ * if the arena is shared.
+ */
+static void block_free_exact(buddy_arena_t *arena, void *addr){
+  char *cur = addr;
+  page_t page;
+
+  do {
+    page_t *head = page_of(arena, cur);
+    char *next = cur + ((size_t)1 << PAGE_ORDER(*head));
+
+    page = *head;
+    *head = PAGE_ALLOC | PAGE_ORDER(page);
+    block_free(arena, cur);
+    cur = next;
+  } while(PAGE_STATE(page) == PAGE_CONT);
+}
+
+/**
+ * qsort() comparator ordering block addresses
+ */
+static int addr_cmp(const void *a, const void *b){
+  char *x = *(char * const *)a;
+  char *y = *(char * const *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Free count blocks at once. The blocks are sorted by address first so that
+ * allocated buddies end up next to each other and can be merged on a stack
+ * before any free list is touched; only the merged blocks go through
+ * block_free(). Called with the arena lock held if the arena is shared.
+ *
+ * @param arena arena the blocks were allocated from
+ * @param addrs block addresses, reordered in place
+ * @param count number of blocks
+ */
+static void block_free_bulk(buddy_arena_t *arena, void **addrs, size_t count){
+  size_t top = 0;
+  size_t i;
+
+  // Batches are often freed in the order buddy_arena_alloc_bulk() returned
+  // them, which is already sorted
+  for (i = 1; i < count && addrs[i - 1] < addrs[i]; i++) {
+  }
+  if(i < count){
+    qsort(addrs, count, sizeof(void *), addr_cmp);
+  }
+
+  // addrs[0, top) is the merge stack; it only ever shrinks behind i
+  for (i = 0; i < count; i++) {
+    addrs[top++] = addrs[i];
+    while(top >= 2){
+      page_t *lo = page_of(arena, addrs[top - 2]);
+      page_t *hi = page_of(arena, addrs[top - 1]);
+      int order = PAGE_ORDER(*lo);
+
+      if(*hi != *lo || order >= arena -> max_order ||
+          BUDDY_ADDR(arena, addrs[top - 2], order) != addrs[top - 1]){
+        break;
+      }
+      *hi = PAGE_ALLOC;
+      *lo = PAGE_ALLOC | (order + 1);
+      arena -> merges++;
+      top--;
+    }
+  }
+
+  for (i = 0; i < top; i++) {
+    block_free(arena, addrs[i]);
+  }
+}
+
+/**************************************************************************
+ * Thread Cache Functions
+ **************************************************************************/
+
+/**
+ * Add n to one of the counters of a counters_t. Counters with a single
+ * writer (shared is 0) get a plain relaxed load and store, which is all a
+ * concurrent reader needs; only counters several threads update at once
+ * take a read-modify-write.
+ */
+static inline void counter_add(atomic_ullong *counter, unsigned long long n, int shared){
+  if(shared){
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+  }
+  else{
+    atomic_store_explicit(counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+  }
+}
+
+/**
+ * Add the counters of from to those of to
+ */
+static void counters_merge(counters_t *to, counters_t *from, int shared){
+  counter_add(&to -> allocs, atomic_load_explicit(&from -> allocs, memory_order_relaxed), shared);
+  counter_add(&to -> frees, atomic_load_explicit(&from -> frees, memory_order_relaxed), shared);
+  counter_add(&to -> total_requested,
+      atomic_load_explicit(&from -> total_requested, memory_order_relaxed), shared);
+  counter_add(&to -> total_allocated,
+      atomic_load_explicit(&from -> total_allocated, memory_order_relaxed), shared);
+  counter_add(&to -> requested,
+      atomic_load_explicit(&from -> requested, memory_order_relaxed), shared);
+  counter_add(&to -> allocated,
+      atomic_load_explicit(&from -> allocated, memory_order_relaxed), shared);
+}
+
+/**
+ * Return every block cached in tc to the free lists. Called with the arena
+ * lock held.
+ */
+static void tcache_flush_locked(buddy_arena_t *arena, tcache_t *tc){
+  int i;
+  for (i = 0; i < BUDDY_MAG_ORDERS; i++) {
+    magazine_t *mag = &tc -> mags[i];
+    while(mag -> count > 0){
+      block_free(arena, mag -> blocks[--mag -> count]);
+    }
+  }
+}
+
+/**
+ * Thread exit destructor of an arena's tcache_key
+ */
+static void tcache_destroy(void *arg){
+  tcache_t *tc = arg;
+  buddy_arena_t *arena = tc -> arena;
+
+  pthread_mutex_lock(&arena -> lock);
+  tcache_flush_locked(arena, tc);
+  list_del(&tc -> list);
+  counters_merge(&arena -> ctr, &tc -> ctr, 1);
+  pthread_mutex_unlock(&arena -> lock);
+  meta_free(tc, sizeof(*tc));
+}
+
+/**
+ * The calling thread's cache for arena, created on first use
+ *
+ * @return the cache, or NULL if it could not be allocated
+ */
+static tcache_t *tcache_get(buddy_arena_t *arena){
+  /* set while a cache is being registered: pthread_setspecific() may
+   * allocate, which must not recurse when this arena backs malloc() */
+  static __thread int creating;
+
+  tcache_t *tc = pthread_getspecific(arena -> tcache_key);
+  if(tc != NULL || creating){
+    return tc;
+  }
+
+  tc = meta_alloc(sizeof(*tc));
+  if(tc == NULL){
+    return NULL;
+  }
+  tc -> arena = arena;
+
+  creating = 1;
+  pthread_mutex_lock(&arena -> lock);
+  list_add(&tc -> list, &arena -> tcaches);
+  pthread_mutex_unlock(&arena -> lock);
+  pthread_setspecific(arena -> tcache_key, tc);
+  creating = 0;
+  return tc;
+}
+
+/**
+ * Allocate from the shared free lists under the arena lock. If they cannot
+ * satisfy the request the calling thread's magazines are flushed first so
+ * their blocks get a chance to coalesce.
+ */
+static void *shared_alloc(buddy_arena_t *arena, tcache_t *tc, int order){
+  pthread_mutex_lock(&arena -> lock);
+  void *addr = block_alloc(arena, order);
+  if(addr == NULL && tc != NULL){
+    tcache_flush_locked(arena, tc);
+    addr = block_alloc(arena, order);
+  }
+  pthread_mutex_unlock(&arena -> lock);
+  return addr;
+}
+
+/**
+ * Allocate a small block from the calling thread's magazine, refilling it
+ * with half a magazine of blocks in one locked batch when it runs empty.
+ */
+static void *tcache_alloc(buddy_arena_t *arena, int order){
+  tcache_t *tc = tcache_get(arena);
+  if(tc == NULL){
+    return shared_alloc(arena, NULL, order);
+  }
+
+  magazine_t *mag = &tc -> mags[order - arena -> min_order];
+  if(mag -> count == 0){
+    pthread_mutex_lock(&arena -> lock);
+    while(mag -> count < BUDDY_MAG_SIZE / 2){
+      void *addr = block_alloc(arena, order);
+      if(addr == NULL){
+        break;
+      }
+      mag -> blocks[mag -> count++] = addr;
+    }
+    pthread_mutex_unlock(&arena -> lock);
+
+    if(mag -> count == 0){
+      return shared_alloc(arena, tc, order);
+    }
+  }
+  return mag -> blocks[--mag -> count];
+}
+
+/**
+ * Park a small block in the calling thread's magazine, draining half of a
+ * full magazine back to the free lists in one locked batch.
+ */
+static void tcache_free(buddy_arena_t *arena, void *addr, int order){
+  tcache_t *tc = tcache_get(arena);
+  if(tc == NULL){
+    pthread_mutex_lock(&arena -> lock);
+    block_free(arena, addr);
+    pthread_mutex_unlock(&arena -> lock);
+    return;
+  }
+
+  magazine_t *mag = &tc -> mags[order - arena -> min_order];
+  if(mag -> count == BUDDY_MAG_SIZE){
+    pthread_mutex_lock(&arena -> lock);
+    while(mag -> count > BUDDY_MAG_SIZE / 2){
+      block_free(arena, mag -> blocks[--mag -> count]);
+    }
+    pthread_mutex_unlock(&arena -> lock);
+  }
+  mag -> blocks[mag -> count++] = addr;
+}
+
+/**************************************************************************
+ * Lock-Free Stack Functions
+ **************************************************************************/
+
+/*
+ * Blocks on a lock-free stack stay allocated as far as the free lists and
+ * page structures are concerned, so the (locked) split and merge code never
+ * sees them and the stacks need no coordination with it. Blocks only move
+ * between the two under the arena lock, in batches.
+ */
+
+/**
+ * Push an unused block. Never blocks.
+ */
+static void lf_push(buddy_arena_t *arena, lfstack_t *st, void *addr){
+  unsigned long long idx = ADDR_TO_PAGE(arena, addr) + 1;
+  unsigned long long old = atomic_load_explicit(&st -> head, memory_order_relaxed);
+  unsigned long long new;
+
+  do {
+    atomic_store_explicit((_Atomic uint32_t *)addr, (uint32_t)(old & LF_INDEX_MASK),
+        memory_order_relaxed);
+    new = ((old & ~LF_INDEX_MASK) + LF_TAG_ONE) | idx;
+  } while(!atomic_compare_exchange_weak_explicit(&st -> head, &old, new,
+        memory_order_release, memory_order_relaxed));
+
+  atomic_fetch_add_explicit(&st -> count, 1, memory_order_relaxed);
+}
+
+/**
+ * Pop an unused block. Never blocks.
+ *
+ * The next link is read from a block that another thread may have popped
+ * and reused in the meantime; the value is then garbage, but the tag bump of
+ * that pop makes our compare-and-swap fail, so it is never installed.
+ *
+ * @return a block, or NULL if the stack is empty
+ */
+static void *lf_pop(buddy_arena_t *arena, lfstack_t *st){
+  unsigned long long old = atomic_load_explicit(&st -> head, memory_order_acquire);
+  unsigned long long new;
+  void *addr;
+
+  do {
+    unsigned long long idx = old & LF_INDEX_MASK;
+    if(idx == 0){
+      return NULL;
+    }
+    addr = PAGE_TO_ADDR(arena, idx - 1);
+    uint32_t next = atomic_load_explicit((_Atomic uint32_t *)addr, memory_order_relaxed);
+    new = ((old & ~LF_INDEX_MASK) + LF_TAG_ONE) | next;
+  } while(!atomic_compare_exchange_weak_explicit(&st -> head, &old, new,
+        memory_order_acquire, memory_order_acquire));
+
+  atomic_fetch_sub_explicit(&st -> count, 1, memory_order_relaxed);
+  return addr;
+}
+
+/**
+ * Return every block on the lock-free stacks to the free lists. Called with
+ * the arena lock held.
+ */
+static void lf_drain_locked(buddy_arena_t *arena){
+  int i;
+  for (i = 0; i < BUDDY_LF_ORDERS; i++) {
+    void *addr;
+    while((addr = lf_pop(arena, &arena -> lfstacks[i])) != NULL){
+      block_free(arena, addr);
+    }
+  }
+}
+
+/**
+ * Allocate from the lock-free stack of order. An empty stack is refilled
+ * with a batch of blocks from the free lists under the arena lock.
+ */
+static void *lf_alloc(buddy_arena_t *arena, int order){
+  lfstack_t *st = &arena -> lfstacks[order - arena -> min_order];
+  void *addr = lf_pop(arena, st);
+  int i;
+
+  if(addr != NULL){
+    return addr;
+  }
+
+  pthread_mutex_lock(&arena -> lock);
+  addr = block_alloc(arena, order);
+  if(addr == NULL){
+    lf_drain_locked(arena);
+    addr = block_alloc(arena, order);
+  }
+  for (i = 1; addr != NULL && i < BUDDY_LF_BATCH; i++) {
+    void *extra = block_alloc(arena, order);
+    if(extra == NULL){
+      break;
+    }
+    lf_push(arena, st, extra);
+  }
+  pthread_mutex_unlock(&arena -> lock);
+  return addr;
+}
+
+/**
+ * Free onto the lock-free stack of order unless it is already full.
+ */
+static void lf_free(buddy_arena_t *arena, void *addr, int order){
+  lfstack_t *st = &arena -> lfstacks[order - arena -> min_order];
+
+  if(atomic_load_explicit(&st -> count, memory_order_relaxed) < BUDDY_LF_DEPTH){
+    lf_push(arena, st, addr);
+    return;
+  }
+  pthread_mutex_lock(&arena -> lock);
+  block_free(arena, addr);
+  pthread_mutex_unlock(&arena -> lock);
+}
+
+/**************************************************************************
+ * Slab Functions
+ **************************************************************************/
+
+/**
+ * Size class index of a request of at most BUDDY_SLAB_MAX bytes
+ */
+static inline int slab_class(size_t size){
+  if(size <= ((size_t)1 << BUDDY_SLAB_MIN_SHIFT)){
+    return 0;
+  }
+  return 64 - __builtin_clzll(size - 1) - BUDDY_SLAB_MIN_SHIFT;
+}
+
+/**
+ * Order of the blocks slabs of class cls are built from: the smallest one
+ * that holds the header and BUDDY_SLAB_MIN_OBJS objects, and at least a
+ * page. buddy_arena_create_opts() makes sure it is at most max_order.
+ */
+static inline int slab_order(const buddy_arena_t *arena, int cls){
+  size_t objsize = (size_t)1 << (cls + BUDDY_SLAB_MIN_SHIFT);
+  int order = ceil_order(BUDDY_SLAB_HEADER + BUDDY_SLAB_MIN_OBJS * BUDDY_SLAB_OBJ_BYTES(objsize));
+
+  return order > arena -> min_order ? order : arena -> min_order;
+}
+
+/**
+ * Build a new slab of class cls from a fresh block. Called with the arena
+ * lock held.
+ *
+ * @return the slab, or NULL if no block is left
+ */
+static slab_t *slab_create(buddy_arena_t *arena, int cls){
+  int order = slab_order(arena, cls);
+  size_t objsize = (size_t)1 << (cls + BUDDY_SLAB_MIN_SHIFT);
+  slab_t *slab = block_alloc(arena, order);
+  size_t i;
+
+  if(slab == NULL){
+    return NULL;
+  }
+
+  page_t *pages = page_of(arena, slab);
+  for (i = 0; i < ((size_t)1 << (order - arena -> min_order)); i++) {
+    pages[i] = PAGE_SLAB | order;
+  }
+
+  size_t nobjs = (((size_t)1 << order) - BUDDY_SLAB_HEADER) / BUDDY_SLAB_OBJ_BYTES(objsize);
+  if(nobjs > BUDDY_SLAB_MAX_OBJS){
+    nobjs = BUDDY_SLAB_MAX_OBJS;
+  }
+  slab -> cls = cls;
+  slab -> nobjs = nobjs;
+  slab -> nfree = nobjs;
+  for (i = 0; i < BUDDY_SLAB_MAX_OBJS / 64; i++) {
+    size_t bits = nobjs > i * 64 ? nobjs - i * 64 : 0;
+    slab -> bitmap[i] = bits >= 64 ? ~0ull : (1ull << bits) - 1;
+  }
+  list_add(&slab -> list, &arena -> slabs[cls]);
+  return slab;
+}
+
+/**
+ * Allocate an object of at most BUDDY_SLAB_MAX bytes. Called with the arena
+ * lock held.
+ */
+static void *slab_alloc(buddy_arena_t *arena, size_t size){
+  int cls = slab_class(size);
+  slab_t *slab;
+  int i;
+
+  if(list_empty(&arena -> slabs[cls])){
+    if(slab_create(arena, cls) == NULL){
+      return NULL;
+    }
+  }
+  slab = list_entry(arena -> slabs[cls].next, slab_t, list);
+
+  for (i = 0; slab -> bitmap[i] == 0; i++) {
+  }
+  int bit = __builtin_ctzll(slab -> bitmap[i]);
+  slab -> bitmap[i] &= ~(1ull << bit);
+
+  if(--slab -> nfree == 0){
+    list_del_init(&slab -> list);
+  }
+  return (char *)slab + BUDDY_SLAB_HEADER +
+    ((size_t)(i * 64 + bit) << (cls + BUDDY_SLAB_MIN_SHIFT));
+}
+
+/**
+ * The slab that owns a slab object
+ */
+static inline slab_t *slab_of(buddy_arena_t *arena, void *addr){
+  int order = PAGE_ORDER(*page_of(arena, addr));
+  size_t offset = (char *)addr - arena -> base;
+  return (slab_t *)(arena -> base + (offset & ~(((size_t)1 << order) - 1)));
+}
+
+/**
+ * Index of a slab object in its slab
+ */
+static inline size_t slab_index(const slab_t *slab, const void *addr){
+  return ((const char *)addr - (const char *)slab - BUDDY_SLAB_HEADER) >>
+    (slab -> cls + BUDDY_SLAB_MIN_SHIFT);
+}
+
+/**
+ * Slack slots of a slab's objects, after the last object
+ */
+static inline uint16_t *slab_slack(slab_t *slab){
+  return (uint16_t *)((char *)slab + BUDDY_SLAB_HEADER +
+      ((size_t)slab -> nobjs << (slab -> cls + BUDDY_SLAB_MIN_SHIFT)));
+}
+
+/**
+ * Free a slab object. A slab that becomes empty goes back to the buddy
+ * free lists unless it is the only one of its class with free objects.
+ * Called with the arena lock held.
+ */
+static void slab_free(buddy_arena_t *arena, void *addr){
+  slab_t *slab = slab_of(arena, addr);
+  int cls = slab -> cls;
+  size_t idx = slab_index(slab, addr);
+  size_t i;
+
+  slab -> bitmap[idx / 64] |= 1ull << (idx % 64);
+  if(slab -> nfree++ == 0){
+    list_add(&slab -> list, &arena -> slabs[cls]);
+  }
+
+  if(slab -> nfree == slab -> nobjs && arena -> slabs[cls].next != arena -> slabs[cls].prev){
+    list_del(&slab -> list);
+
+    page_t *pages = page_of(arena, slab);
+    int order = PAGE_ORDER(pages[0]);
+    for (i = 0; i < ((size_t)1 << (order - arena -> min_order)); i++) {
+      pages[i] = PAGE_ALLOC;
+    }
+    pages[0] = PAGE_ALLOC | order;
+    block_free(arena, slab);
+  }
+}
+
+/**
+ * Bytes usable at addr: the size class of a slab object, the block size of
+ * a block, or the total of an exact allocation's blocks.
+ */
+static size_t block_size(buddy_arena_t *arena, void *addr){
+  page_t page = *page_of(arena, addr);
+  size_t size = 0;
+
+  if(PAGE_STATE(page) == PAGE_SLAB){
+    return (size_t)1 << (slab_of(arena, addr) -> cls + BUDDY_SLAB_MIN_SHIFT);
+  }
+  size = (size_t)1 << PAGE_ORDER(page);
+  while(PAGE_STATE(page) == PAGE_CONT){
+    page = *page_of(arena, (char *)addr + size);
+    size += (size_t)1 << PAGE_ORDER(page);
+  }
+  return size;
+}
+
+/**************************************************************************
+ * Statistics Functions
+ **************************************************************************/
+
+/**
+ * Counters the calling thread updates: the arena's own unless it is
+ * thread-safe, in which case each thread counts in its tcache_t
+ */
+static inline counters_t *counters(buddy_arena_t *arena, int *shared){
+  *shared = 0;
+  if(arena -> flags & BUDDY_ARENA_THREADSAFE){
+    tcache_t *tc = tcache_get(arena);
+    if(tc != NULL){
+      return &tc -> ctr;
+    }
+    *shared = 1;
+  }
+  return &arena -> ctr;
+}
+
+/**
+ * Where the slack of the allocation at addr is kept: a slot at the end of
+ * its slab for slab objects, its page's slack entry otherwise
+ */
+static inline void *slack_slot(buddy_arena_t *arena, void *addr, int *small){
+  if(PAGE_STATE(*page_of(arena, addr)) == PAGE_SLAB){
+    slab_t *slab = slab_of(arena, addr);
+    *small = 1;
+    return slab_slack(slab) + slab_index(slab, addr);
+  }
+  *small = 0;
+  return &arena -> slack[((char *)addr - arena -> base) >> arena -> min_order];
+}
+
+/**
+ * Bytes handed out for the allocation at addr, and in *requested the bytes
+ * it was asked for
+ */
+static size_t alloc_footprint(buddy_arena_t *arena, void *addr, size_t *requested){
+  size_t allocated = block_size(arena, addr);
+  int small;
+  void *slot = slack_slot(arena, addr, &small);
+
+  *requested = allocated - (small ? *(uint16_t *)slot : *(uint32_t *)slot);
+  return allocated;
+}
+
+/**
+ * Account for an allocation of size bytes at addr (NULL if it failed)
+ */
+static void count_alloc(buddy_arena_t *arena, void *addr, size_t size){
+  if(addr == NULL){
+    int order = size_to_order(arena, size);
+    if((arena -> flags & BUDDY_ARENA_SLAB) && size <= BUDDY_SLAB_MAX){
+      order = slab_order(arena, slab_class(size));
+    }
+    if(order >= BUDDY_ORDERS){
+      order = BUDDY_ORDERS - 1;
+    }
+    atomic_fetch_add_explicit(&arena -> failed[order], 1, memory_order_relaxed);
+    return;
+  }
+
+  /* slack above 4 GiB only arises for huge blocks and is capped, which
+   * understates their waste but keeps alloc and free in balance */
+  size_t allocated = block_size(arena, addr);
+  size_t slack = allocated - size;
+  int small;
+  void *slot = slack_slot(arena, addr, &small);
+  if(small){
+    *(uint16_t *)slot = slack;
+  }
+  else{
+    *(uint32_t *)slot = slack > UINT32_MAX ? UINT32_MAX : slack;
+    size = allocated - *(uint32_t *)slot;
+  }
+
+  int shared;
+  counters_t *c = counters(arena, &shared);
+  counter_add(&c -> allocs, 1, shared);
+  counter_add(&c -> total_requested, size, shared);
+  counter_add(&c -> total_allocated, allocated, shared);
+  counter_add(&c -> requested, size, shared);
+  counter_add(&c -> allocated, allocated, shared);
+}
+
+/**
+ * Account for count frees of allocations of allocated bytes in total, of
+ * which requested were asked for (see alloc_footprint())
+ */
+static void count_free(buddy_arena_t *arena, size_t count, size_t allocated,
+    size_t requested){
+  int shared;
+  counters_t *c = counters(arena, &shared);
+  counter_add(&c -> frees, count, shared);
+  counter_add(&c -> requested, -(unsigned long long)requested, shared);
+  counter_add(&c -> allocated, -(unsigned long long)allocated, shared);
+}
+
+/**************************************************************************
+ * Arena Functions
+ **************************************************************************/
+
+/**
+ * Create an arena managing the memory at base.
+ *
+ * The region is not touched by the allocator other than through the blocks
+ * handed out, apart from the links of free blocks which live in the free
+ * blocks themselves; page metadata takes one byte per page and is allocated
+ * separately.
+ *
+ * @param base start of the region to manage
+ * @param size size of the region in bytes, at least one page
+ * @param min_order log2 of the smallest block size
+ * @return new arena, or NULL if the geometry is invalid or out of memory
+ */
+buddy_arena_t *buddy_arena_create(void *base, size_t size, int min_order){
+
+  struct buddy_arena_opts opts = { .min_order = min_order };
+
+  if(base == NULL){
+    return NULL;
+  }
+  return buddy_arena_create_opts(base, size, &opts);
+}
+
+/**
+ * Create an arena with explicit options.
+ *
+ * When base is NULL the arena reserves its own region with mmap(). The
+ * region is aligned to its largest block and committed lazily by the kernel on first
+ * touch; BUDDY_ARENA_HUGETLB and BUDDY_ARENA_HUGEPAGE request huge pages for
+ * it. If opts->decommit_order is non-zero, free blocks of at least that order
+ * in an arena owned mapping are returned to the OS with MADV_DONTNEED once
+ * they are fully coalesced. BUDDY_ARENA_LAZY defers coalescing of blocks of
+ * the smallest BUDDY_LAZY_ORDERS orders; opts->lazy_high sets how many freed
+ * blocks of min_order may wait (default BUDDY_LAZY_HIGH), half as many of
+ * each order above. BUDDY_ARENA_TREE indexes the free blocks with an
+ * implicit tree of two bytes per page instead of free lists linked through
+ * the blocks, so free memory is never written to.
+ *
+ * The region need not be a power of two: it is cut down to whole pages and
+ * tiled with the largest aligned blocks of at most opts->max_order, which
+ * defaults to the largest power of two that fits. A smaller max_order only
+ * caps the block size, so no allocation can be larger than that.
+ *
+ * @param base start of the region to manage, or NULL to map one
+ * @param size size of the region in bytes, at least one page
+ * @param opts arena options, a zero min_order selects 4 KiB pages
+ * @return new arena, or NULL if the geometry is invalid or out of memory
+ */
+buddy_arena_t *buddy_arena_create_opts(void *base, size_t size,
+    const struct buddy_arena_opts *opts){
+
+  int min_order = opts -> min_order ? opts -> min_order : MIN_ORDER;
+  int max_order;
+  int i;
+
+  if(min_order < BUDDY_MIN_PAGE_ORDER || min_order > PAGE_ORDER_MASK){
+    return NULL;
+  }
+  size &= ~(((size_t)1 << min_order) - 1);
+  if(size == 0 || ceil_order(size) >= BUDDY_ORDERS){
+    return NULL;
+  }
+  max_order = 63 - __builtin_clzll(size);
+  if(opts -> max_order != 0){
+    if(opts -> max_order < min_order || opts -> max_order > max_order){
+      return NULL;
+    }
+    max_order = opts -> max_order;
+  }
+  /* slabs of the largest class need a block for the header and
+   * BUDDY_SLAB_MIN_OBJS objects, see slab_order() */
+  if((opts -> flags & BUDDY_ARENA_SLAB) &&
+      ceil_order(BUDDY_SLAB_HEADER + BUDDY_SLAB_MIN_OBJS * BUDDY_SLAB_OBJ_BYTES(BUDDY_SLAB_MAX)) > max_order){
+    return NULL;
+  }
+  /* lock-free stacks address blocks by a 32 bit page index */
+  if((opts -> flags & BUDDY_ARENA_LOCKFREE) && (size >> min_order) >= LF_INDEX_MASK){
+    return NULL;
+  }
+
+  buddy_arena_t *arena = meta_alloc(sizeof(*arena));
+  if(arena == NULL){
+    return NULL;
+  }
+  page_t *pages = meta_alloc((size >> min_order) * sizeof(page_t));
+  if(pages == NULL){
+    meta_free(arena, sizeof(*arena));
+    return NULL;
+  }
+  uint32_t *slack = meta_alloc((size >> min_order) * sizeof(uint32_t));
+  if(slack == NULL){
+    meta_free(pages, (size >> min_order) * sizeof(page_t));
+    meta_free(arena, sizeof(*arena));
+    return NULL;
+  }
+  uint8_t *tree = NULL;
+  if(opts -> flags & BUDDY_ARENA_TREE){
+    tree = meta_alloc(tree_bytes(size, min_order));
+    if(tree == NULL){
+      meta_free(slack, (size >> min_order) * sizeof(uint32_t));
+      meta_free(pages, (size >> min_order) * sizeof(page_t));
+      meta_free(arena, sizeof(*arena));
+      return NULL;
+    }
+  }
+
+  void *map_base = NULL;
+  size_t map_size = 0;
+  if(base == NULL){
+    base = arena_map(size, (size_t)1 << max_order, opts -> flags, &map_base, &map_size);
+    if(base == NULL){
+      meta_free(tree, tree_bytes(size, min_order));
+      meta_free(slack, (size >> min_order) * sizeof(uint32_t));
+      meta_free(pages, (size >> min_order) * sizeof(page_t));
+      meta_free(arena, sizeof(*arena));
+      return NULL;
+    }
+  }
+
+  /* meta_alloc() memory comes zero-filled from mmap() */
+  arena_init(arena, base, size, min_order, max_order, pages, slack, tree, 1);
+  arena -> flags = opts -> flags;
+  if(arena -> flags & BUDDY_ARENA_LOCKFREE){
+    arena -> flags |= BUDDY_ARENA_THREADSAFE;
+  }
+  arena -> map_base = map_base;
+  arena -> map_size = map_size;
+  if(map_base != NULL && opts -> decommit_order > 0){
+    arena -> decommit_order = opts -> decommit_order;
+  }
+  for (i = 0; opts -> lazy_high > 0 && i < BUDDY_LAZY_ORDERS; i++) {
+    size_t high = opts -> lazy_high;
+    arena -> pending_high[i] = high >> i > 0 ? high >> i : 1;
+  }
+
+  INIT_LIST_HEAD(&arena -> tcaches);
+  for (i = 0; i < BUDDY_SLAB_CLASSES; i++) {
+    INIT_LIST_HEAD(&arena -> slabs[i]);
+  }
+  for (i = 0; i < BUDDY_LF_ORDERS; i++) {
+    atomic_init(&arena -> lfstacks[i].head, 0);
+    atomic_init(&arena -> lfstacks[i].count, 0);
+  }
+  if(arena -> flags & BUDDY_ARENA_THREADSAFE){
+    pthread_mutex_init(&arena -> lock, NULL);
+    if(pthread_key_create(&arena -> tcache_key, tcache_destroy) != 0){
+      pthread_mutex_destroy(&arena -> lock);
+      arena -> flags &= ~BUDDY_ARENA_THREADSAFE;
+      buddy_arena_destroy(arena);
+      return NULL;
+    }
+  }
+  return arena;
+}
+
+/**
+ * Release an arena created with buddy_arena_create(). A region passed in as
+ * base belongs to the caller and is left alone. For a thread-safe arena no
+ * other thread may use it any more.
+ *
+ * @param arena arena to destroy
+ */
+void buddy_arena_destroy(buddy_arena_t *arena){
+  if(arena == NULL || arena == &default_arena){
+    return;
+  }
+  if(arena -> flags & BUDDY_ARENA_THREADSAFE){
+    pthread_key_delete(arena -> tcache_key);
+    while(!list_empty(&arena -> tcaches)){
+      tcache_t *tc = list_entry(arena -> tcaches.next, tcache_t, list);
+      list_del(&tc -> list);
+      meta_free(tc, sizeof(*tc));
+    }
+    pthread_mutex_destroy(&arena -> lock);
+  }
+  if(arena -> map_base != NULL){
+    munmap(arena -> map_base, arena -> map_size);
+  }
+  meta_free(arena -> tree, tree_bytes(arena -> size, arena -> min_order));
+  meta_free(arena -> slack, arena -> n_pages * sizeof(uint32_t));
+  meta_free(arena -> pages, arena -> n_pages * sizeof(page_t));
+  meta_free(arena, sizeof(*arena));
+}
+
+/**
+ * Allocate a block from the free lists, magazines, lock-free stacks or
+ * slabs as the arena flags dictate; see buddy_arena_alloc().
+ */
+static void *arena_alloc(buddy_arena_t *arena, size_t size){
+
+  if(PRINT){printf("ADDING BLOCK size is currently [%zu] \n", size);}
+
+  if((arena -> flags & BUDDY_ARENA_SLAB) && size <= BUDDY_SLAB_MAX){
+    if(!(arena -> flags & BUDDY_ARENA_THREADSAFE)){
+      return slab_alloc(arena, size);
+    }
+    pthread_mutex_lock(&arena -> lock);
+    void *addr = slab_alloc(arena, size);
+    pthread_mutex_unlock(&arena -> lock);
+    return addr;
+  }
+
+  int order = size_to_order(arena, size);
+  if(order > arena -> max_order){
+    return NULL;
+  }
+
+  if(!(arena -> flags & BUDDY_ARENA_THREADSAFE)){
+    return block_alloc(arena, order);
+  }
+  if(arena -> flags & BUDDY_ARENA_LOCKFREE){
+    if(order < arena -> min_order + BUDDY_LF_ORDERS){
+      return lf_alloc(arena, order);
+    }
+    pthread_mutex_lock(&arena -> lock);
+    void *addr = block_alloc(arena, order);
+    if(addr == NULL){
+      lf_drain_locked(arena);
+      addr = block_alloc(arena, order);
+    }
+    pthread_mutex_unlock(&arena -> lock);
+    return addr;
+  }
+  if(order < arena -> min_order + BUDDY_MAG_ORDERS){
+    return tcache_alloc(arena, order);
+  }
+  return shared_alloc(arena, pthread_getspecific(arena -> tcache_key), order);
+}
+
+/**
+ * Free a block to wherever it came from; see buddy_arena_free().
+ */
+static void arena_free(buddy_arena_t *arena, void *addr){
+
+  page_t page = *page_of(arena, addr);
+  if(PAGE_STATE(page) == PAGE_SLAB || PAGE_STATE(page) == PAGE_CONT){
+    int shared = arena -> flags & BUDDY_ARENA_THREADSAFE;
+    if(shared){
+      pthread_mutex_lock(&arena -> lock);
+    }
+    if(PAGE_STATE(page) == PAGE_SLAB){
+      slab_free(arena, addr);
+    }
+    else{
+      block_free_exact(arena, addr);
+    }
+    if(shared){
+      pthread_mutex_unlock(&arena -> lock);
+    }
+    return;
+  }
+
+  if(!(arena -> flags & BUDDY_ARENA_THREADSAFE)){
+    block_free(arena, addr);
+    return;
+  }
+
+  int order = PAGE_ORDER(page);
+  if(arena -> flags & BUDDY_ARENA_LOCKFREE){
+    if(order < arena -> min_order + BUDDY_LF_ORDERS){
+      lf_free(arena, addr, order);
+      return;
+    }
+  }
+  else if(order < arena -> min_order + BUDDY_MAG_ORDERS){
+    tcache_free(arena, addr, order);
+    return;
+  }
+  pthread_mutex_lock(&arena -> lock);
+  block_free(arena, addr);
+  pthread_mutex_unlock(&arena -> lock);
+}
+
+/**
+ * Allocate a memory block.
+ *
+ * The request is rounded up to a power of two block of at least one page.
+ * In a BUDDY_ARENA_SLAB arena requests of up to BUDDY_SLAB_MAX bytes are
+ * instead carved out of slabs of the matching 16 B to 2 KiB size class.
+ * In a thread-safe arena the smallest BUDDY_MAG_ORDERS orders come from the
+ * calling thread's magazines without taking the lock; a lock-free arena
+ * serves the smallest BUDDY_LF_ORDERS orders from shared lock-free stacks
+ * instead.
+ *
+ * @param arena arena to allocate from
+ * @param size size in bytes
+ * @return memory block address, or NULL if no block is large enough
+ */
+void *buddy_arena_alloc(buddy_arena_t *arena, size_t size){
+  void *addr = arena_alloc(arena, size);
+  count_alloc(arena, addr, size);
+  return addr;
+}
+
+/**
+ * Free an allocated memory block.
+ *
+ * Slab objects are found through the slab state of their page and returned
+ * to their slab; all blocks of an exact allocation are freed together. In a
+ * thread-safe arena small blocks go to the calling thread's magazine (or the
+ * lock-free stack of their order) and only reach the free lists when it
+ * overflows.
+ *
+ * @param arena arena the block was allocated from
+ * @param addr memory block address to be freed, NULL is ignored
+ */
+void buddy_arena_free(buddy_arena_t *arena, void *addr){
+  if(addr == NULL){
+    return;
+  }
+  size_t requested;
+  size_t allocated = alloc_footprint(arena, addr, &requested);
+  count_free(arena, 1, allocated, requested);
+  arena_free(arena, addr);
+}
+
+/**
+ * Allocate exactly size bytes, rounded up to whole pages.
+ *
+ * Instead of a whole power of two block, the allocation is a run of
+ * adjacent blocks (an 80 KiB request takes 64 KiB + 16 KiB rather than
+ * 128 KiB) and the unused tail goes straight back to the free lists.
+ * buddy_arena_free() releases all of its blocks.
+ *
+ * @param arena arena to allocate from
+ * @param size size in bytes
+ * @return memory address, or NULL if no block is large enough
+ */
+void *buddy_arena_alloc_exact(buddy_arena_t *arena, size_t size){
+
+  if(size > arena -> size){
+    return NULL;
+  }
+  size_t pages = (size + PAGE_SIZE(arena) - 1) >> arena -> min_order;
+  size = pages << arena -> min_order;
+
+  if(size == 0 || (size & (size - 1)) == 0){
+    return buddy_arena_alloc(arena, size);
+  }
+  if(size_to_order(arena, size) > arena -> max_order){
+    return NULL;
+  }
+
+  int shared = arena -> flags & BUDDY_ARENA_THREADSAFE;
+  if(shared){
+    pthread_mutex_lock(&arena -> lock);
+  }
+  void *addr = block_alloc_exact(arena, size);
+  if(shared){
+    pthread_mutex_unlock(&arena -> lock);
+  }
+  count_alloc(arena, addr, size);
+  return addr;
+}
+
+/**
+ * Resize an allocated memory block.
+ *
+ * A block shrinks in place by freeing its upper halves and grows in place
+ * when the buddies to its right are free; the data is only copied to a new
+ * block when growing in place is impossible. Slab objects and exact
+ * allocations stay put while the new size still fits them, and move
+ * otherwise.
+ *
+ * @param arena arena the block was allocated from
+ * @param addr block to resize; NULL behaves like buddy_arena_alloc()
+ * @param size new size in bytes; 0 frees the block and returns NULL
+ * @return address of the resized block, or NULL if it could not be resized
+ * (the original block is then left untouched)
+ */
+void *buddy_arena_realloc(buddy_arena_t *arena, void *addr, size_t size){
+
+  if(addr == NULL){
+    return buddy_arena_alloc(arena, size);
+  }
+  if(size == 0){
+    buddy_arena_free(arena, addr);
+    return NULL;
+  }
+
+  int shared = arena -> flags & BUDDY_ARENA_THREADSAFE;
+  size_t old_size;
+  size_t old_requested;
+  size_t old_allocated = alloc_footprint(arena, addr, &old_requested);
+  int in_place = 0;
+
+  if(shared){
+    pthread_mutex_lock(&arena -> lock);
+  }
+
+  page_t page = *page_of(arena, addr);
+  if(PAGE_STATE(page) == PAGE_SLAB || PAGE_STATE(page) == PAGE_CONT){
+    old_size = block_size(arena, addr);
+    in_place = size <= old_size;
+  }
+  else{
+    int order = PAGE_ORDER(page);
+    int new_order = size_to_order(arena, size);
+
+    old_size = (size_t)1 << order;
+    if(new_order <= order){
+      block_shrink(arena, addr, new_order);
+      in_place = 1;
+    }
+    else if(new_order <= arena -> max_order){
+      in_place = block_grow(arena, addr, new_order);
+    }
+  }
+
+  if(shared){
+    pthread_mutex_unlock(&arena -> lock);
+  }
+  if(in_place){
+    // Counted like a move, so the internal fragmentation sees the new size
+    count_free(arena, 1, old_allocated, old_requested);
+    count_alloc(arena, addr, size);
+    return addr;
+  }
+
+  void *new = buddy_arena_alloc(arena, size);
+  if(new == NULL){
+    return NULL;
+  }
+  memcpy(new, addr, old_size < size ? old_size : size);
+  buddy_arena_free(arena, addr);
+  return new;
+}
+
+/**
+ * Allocate count blocks of the same size in one go.
+ *
+ * The size class or order is computed once, a thread-safe arena is locked
+ * once, and each larger free block is split only once for all the pieces
+ * it provides. Magazines and lock-free stacks are bypassed.
+ *
+ * @param arena arena to allocate from
+ * @param size size in bytes of every block
+ * @param count number of blocks
+ * @param out receives count block addresses
+ * @return number of blocks allocated; fewer than count means out of memory
+ */
+size_t buddy_arena_alloc_bulk(buddy_arena_t *arena, size_t size, size_t count,
+    void **out){
+
+  int shared = arena -> flags & BUDDY_ARENA_THREADSAFE;
+  size_t n = 0;
+  size_t i;
+
+  if(shared){
+    pthread_mutex_lock(&arena -> lock);
+  }
+
+  if((arena -> flags & BUDDY_ARENA_SLAB) && size <= BUDDY_SLAB_MAX){
+    while(n < count && (out[n] = slab_alloc(arena, size)) != NULL){
+      n++;
+    }
+  }
+  else{
+    int order = size_to_order(arena, size);
+    if(order <= arena -> max_order){
+      n = block_alloc_bulk(arena, order, count, out);
+    }
+  }
+
+  if(shared){
+    pthread_mutex_unlock(&arena -> lock);
+  }
+  for (i = 0; i < n; i++) {
+    count_alloc(arena, out[i], size);
+  }
+  if(n < count){
+    count_alloc(arena, NULL, size);
+  }
+  return n;
+}
+
+/**
+ * Free count blocks in one go.
+ *
+ * Blocks are sorted by address so that buddies freed together are merged
+ * with each other before touching the free lists, and a thread-safe arena
+ * is locked once for the whole batch.
+ *
+ * @param arena arena the blocks were allocated from
+ * @param addrs block addresses, NULL entries are ignored; the array is
+ * reordered
+ * @param count number of entries in addrs
+ */
+void buddy_arena_free_bulk(buddy_arena_t *arena, void **addrs, size_t count){
+
+  int shared = arena -> flags & BUDDY_ARENA_THREADSAFE;
+  size_t blocks = 0;
+  size_t freed = 0;
+  size_t allocated = 0;
+  size_t requested = 0;
+  size_t i;
+
+  if(shared){
+    pthread_mutex_lock(&arena -> lock);
+  }
+
+  // Slab objects and exact allocations are freed one by one, the rest are
+  // compacted to the front
+  for (i = 0; i < count; i++) {
+    if(addrs[i] == NULL){
+      continue;
+    }
+    size_t req;
+    freed++;
+    allocated += alloc_footprint(arena, addrs[i], &req);
+    requested += req;
+    page_t page = *page_of(arena, addrs[i]);
+    if(PAGE_STATE(page) == PAGE_SLAB){
+      slab_free(arena, addrs[i]);
+    }
+    else if(PAGE_STATE(page) == PAGE_CONT){
+      block_free_exact(arena, addrs[i]);
+    }
+    else{
+      addrs[blocks++] = addrs[i];
+    }
+  }
+  block_free_bulk(arena, addrs, blocks);
+
+  if(shared){
+    pthread_mutex_unlock(&arena -> lock);
+  }
+  count_free(arena, freed, allocated, requested);
+}
+
+/**
+ * Read the allocator statistics of an arena.
+ *
+ * Everything is maintained incrementally, so this is cheap enough to poll.
+ * Blocks cached in magazines, on lock-free stacks, on pending lists or as
+ * slabs count as in use. In a thread-safe arena the per-thread counters of running threads
+ * are read without stopping them and may lag slightly.
+ *
+ * @param arena arena to inspect
+ * @param stats filled in with the current statistics
+ */
+void buddy_arena_stats(buddy_arena_t *arena, struct buddy_stats *stats){
+  int shared = arena -> flags & BUDDY_ARENA_THREADSAFE;
+  struct list_head *pos;
+  int o;
+
+  memset(stats, 0, sizeof(*stats));
+  if(shared){
+    pthread_mutex_lock(&arena -> lock);
+  }
+
+  counters_t total;
+  memset(&total, 0, sizeof(total));
+  counters_merge(&total, &arena -> ctr, 0);
+  if(shared){
+    list_for_each(pos, &arena -> tcaches) {
+      counters_merge(&total, &list_entry(pos, tcache_t, list) -> ctr, 0);
+    }
+  }
+  stats -> allocs = atomic_load_explicit(&total.allocs, memory_order_relaxed);
+  stats -> frees = atomic_load_explicit(&total.frees, memory_order_relaxed);
+  stats -> total_bytes_requested = atomic_load_explicit(&total.total_requested, memory_order_relaxed);
+  stats -> total_bytes_allocated = atomic_load_explicit(&total.total_allocated, memory_order_relaxed);
+  stats -> bytes_requested = atomic_load_explicit(&total.requested, memory_order_relaxed);
+  stats -> bytes_allocated = atomic_load_explicit(&total.allocated, memory_order_relaxed);
+  if(stats -> bytes_allocated != 0){
+    stats -> internal_fragmentation = 1.0 - (double)stats -> bytes_requested / stats -> bytes_allocated;
+  }
+  stats -> splits = arena -> splits;
+  stats -> merges = arena -> merges;
+  for (o = 0; o < BUDDY_ORDERS && o < BUDDY_STATS_ORDERS; o++) {
+    stats -> failed_allocs[o] = atomic_load_explicit(&arena -> failed[o], memory_order_relaxed);
+  }
+
+  stats -> bytes_free = arena -> bytes_free;
+  stats -> bytes_in_use = arena -> size - arena -> bytes_free;
+  if(arena -> free_mask != 0){
+    stats -> largest_free = (size_t)1 << (63 - __builtin_clzll(arena -> free_mask));
+    stats -> external_fragmentation = 1.0 - (double)stats -> largest_free / stats -> bytes_free;
+  }
+
+  if(shared){
+    pthread_mutex_unlock(&arena -> lock);
+  }
+}
+
+/**
+ * Bytes usable at an allocated address: the size class of a slab object,
+ * the block size of a block, or the total of an exact allocation's blocks.
+ * Found from the page metadata in O(1) (O(log n) for exact allocations).
+ *
+ * @param arena arena addr was allocated from
+ * @param addr allocated address
+ * @return usable size in bytes
+ */
+size_t buddy_arena_usable_size(buddy_arena_t *arena, void *addr){
+  return block_size(arena, addr);
+}
+
+/**
+ * Whether an address lies inside the region an arena manages
+ *
+ * @param arena arena to check
+ * @param addr address to check
+ * @return non-zero if addr belongs to the arena
+ */
+int buddy_arena_owns(const buddy_arena_t *arena, const void *addr){
+  return (const char *)addr >= (const char *)arena -> base &&
+    (const char *)addr < (const char *)arena -> base + arena -> size;
+}
+
+/**
+ * Return the blocks cached by the calling thread, those on the lock-free
+ * stacks and those on the pending lists to the free lists so they can
+ * coalesce.
+ *
+ * @param arena arena to flush
+ */
+void buddy_arena_flush(buddy_arena_t *arena){
+  if(!(arena -> flags & BUDDY_ARENA_THREADSAFE)){
+    pending_drain_all(arena);
+    return;
+  }
+  tcache_t *tc = pthread_getspecific(arena -> tcache_key);
+  pthread_mutex_lock(&arena -> lock);
+  if(tc != NULL){
+    tcache_flush_locked(arena, tc);
+  }
+  if(arena -> flags & BUDDY_ARENA_LOCKFREE){
+    lf_drain_locked(arena);
+  }
+  pending_drain_all(arena);
+  pthread_mutex_unlock(&arena -> lock);
+}
+
+/**
+ * Print the buddy system status---order oriented
+ *
+ * print free pages in each order, from counts kept by the free lists so the
+ * dump is O(orders). Blocks cached in thread magazines, on lock-free stacks
+ * or on pending lists count as allocated.
+ *
+ * @param arena arena to print
+ */
+void buddy_arena_dump(buddy_arena_t *arena){
+  int o;
+
+  if(arena -> flags & BUDDY_ARENA_THREADSAFE){
+    pthread_mutex_lock(&arena -> lock);
+  }
+  for (o = arena -> min_order; o <= arena -> max_order; o++) {
+    printf("%zu:%zuK ", arena -> free_count[o], ((size_t)1<<o)/1024);
+  }
+  printf("\n");
+
+  if(arena -> flags & BUDDY_ARENA_THREADSAFE){
+    pthread_mutex_unlock(&arena -> lock);
+  }
+}
+
+/**************************************************************************
+ * Sharded Arena Functions
+ **************************************************************************/
+
+/**
+ * Create n_shards thread-safe arenas over one mapping of size bytes.
+ *
+ * Allocations go to the shard of the calling CPU and, when it cannot
+ * satisfy them, to the other shards in turn; frees go to the shard whose
+ * address range holds the block, directly from its own CPU and through its
+ * remote-free queue from any other. Each shard gets opts with
+ * BUDDY_ARENA_THREADSAFE forced on, so threads that share a CPU or migrate
+ * between CPUs are still safe.
+ *
+ * Every shard is a BUDDY_ARENA_THREADSAFE arena with a pthread key of its
+ * own, so a shard set takes n_shards of the process's PTHREAD_KEYS_MAX
+ * (1024 on glibc) keys: with one shard per CPU on a large machine, only a
+ * few shard sets can exist at once. Pass a smaller n_shards to create more.
+ *
+ * @param size total bytes, split evenly between the shards
+ * @param n_shards number of shards, 0 for one per configured CPU (see
+ * above for the pthread key cost)
+ * @param opts options of every shard, as for buddy_arena_create_opts()
+ * @return new sharded arena, or NULL if the geometry is invalid or out of
+ * memory
+ */
+buddy_shards_t *buddy_shards_create(size_t size, int n_shards,
+    const struct buddy_arena_opts *opts){
+
+  struct buddy_arena_opts shard_opts = *opts;
+  int min_order = opts -> min_order ? opts -> min_order : MIN_ORDER;
+  int max_order;
+  int i;
+
+  if(n_shards <= 0){
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    n_shards = cpus > 0 ? cpus : 1;
+  }
+  if(min_order < BUDDY_MIN_PAGE_ORDER || min_order > PAGE_ORDER_MASK){
+    return NULL;
+  }
+
+  size_t shard_size = (size / n_shards) & ~(((size_t)1 << min_order) - 1);
+  if(shard_size == 0){
+    return NULL;
+  }
+  max_order = 63 - __builtin_clzll(shard_size);
+  if(opts -> max_order != 0){
+    if(opts -> max_order < min_order || opts -> max_order > max_order){
+      return NULL;
+    }
+    max_order = opts -> max_order;
+  }
+  size_t align = (size_t)1 << max_order;
+  size_t stride = (shard_size + align - 1) & ~(align - 1);
+
+  size_t meta_size = sizeof(buddy_shards_t) + n_shards * sizeof(shard_t);
+  buddy_shards_t *shards = meta_alloc(meta_size);
+  if(shards == NULL){
+    return NULL;
+  }
+  shards -> base = arena_map(stride * n_shards, align, opts -> flags,
+      &shards -> map_base, &shards -> map_size);
+  if(shards -> base == NULL){
+    meta_free(shards, meta_size);
+    return NULL;
+  }
+  shards -> stride = stride;
+  shards -> n_shards = 0;
+  shards -> n_slots = n_shards;
+  atomic_init(&shards -> steals, 0);
+
+  shard_opts.flags |= BUDDY_ARENA_THREADSAFE;
+  for (i = 0; i < n_shards; i++) {
+    atomic_init(&shards -> shards[i].remote, NULL);
+    shards -> shards[i].arena = buddy_arena_create_opts(shards -> base + i * stride,
+        shard_size, &shard_opts);
+    if(shards -> shards[i].arena == NULL){
+      buddy_shards_destroy(shards);
+      return NULL;
+    }
+    shards -> n_shards++;
+    /* the memory is ours to decommit even though the shard did not map it */
+    if(opts -> decommit_order > 0){
+      shards -> shards[i].arena -> decommit_order = opts -> decommit_order;
+    }
+  }
+  return shards;
+}
+
+/**
+ * Destroy a sharded arena and unmap its memory
+ *
+ * @param shards sharded arena to destroy
+ */
+void buddy_shards_destroy(buddy_shards_t *shards){
+  int i;
+
+  if(shards == NULL){
+    return;
+  }
+  for (i = 0; i < shards -> n_shards; i++) {
+    buddy_arena_destroy(shards -> shards[i].arena);
+  }
+  munmap(shards -> map_base, shards -> map_size);
+  meta_free(shards, sizeof(buddy_shards_t) + shards -> n_slots * sizeof(shard_t));
+}
+
+/**
+ * Shard of the calling CPU
+ */
+static inline int shard_of_cpu(const buddy_shards_t *shards){
+  int cpu = sched_getcpu();
+  return cpu >= 0 ? cpu % shards -> n_shards : 0;
+}
+
+/**
+ * Shard whose address range holds addr, or -1 if none does
+ */
+static inline int shard_of_addr(const buddy_shards_t *shards, const void *addr){
+  size_t offset = (const char *)addr - shards -> base;
+  if((const char *)addr < shards -> base || offset >= shards -> stride * shards -> n_shards){
+    return -1;
+  }
+  int i = offset / shards -> stride;
+  return buddy_arena_owns(shards -> shards[i].arena, addr) ? i : -1;
+}
+
+/**
+ * Queue a block freed from another CPU on its shard (Treiber stack push)
+ */
+static void shard_remote_push(shard_t *shard, void *addr){
+  void *head = atomic_load_explicit(&shard -> remote, memory_order_relaxed);
+
+  do {
+    *(void **)addr = head;
+  } while(!atomic_compare_exchange_weak_explicit(&shard -> remote, &head, addr,
+      memory_order_release, memory_order_relaxed));
+}
+
+/**
+ * Free every block queued on a shard, in batches that take the arena lock
+ * once and coalesce together. The whole queue is taken at once, so no pop
+ * can suffer from ABA and concurrent drains are safe.
+ *
+ * @return whether anything was freed
+ */
+static int shard_remote_drain(shard_t *shard){
+  void *batch[BUDDY_REMOTE_BATCH];
+  size_t n = 0;
+
+  if(atomic_load_explicit(&shard -> remote, memory_order_relaxed) == NULL){
+    return 0;
+  }
+  void *addr = atomic_exchange_explicit(&shard -> remote, NULL, memory_order_acquire);
+  while(addr != NULL){
+    batch[n++] = addr;
+    addr = *(void **)addr;
+    if(n == BUDDY_REMOTE_BATCH || addr == NULL){
+      buddy_arena_free_bulk(shard -> arena, batch, n);
+      n = 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Allocate from the calling CPU's shard, or steal from the next shard that
+ * has room once it is exhausted. A stolen block stays in the metadata of
+ * the shard it came from, which is where freeing it returns it, so a shard
+ * running dry borrows memory block by block and gets it all back once the
+ * blocks are freed.
+ *
+ * The calling CPU's remote-free queue is drained first, and every queue is
+ * drained before the allocation fails.
+ *
+ * @param shards sharded arena
+ * @param size size in bytes
+ * @return memory block address, or NULL if no shard can satisfy the request
+ */
+void *buddy_shards_alloc(buddy_shards_t *shards, size_t size){
+  int home = shard_of_cpu(shards);
+  int drained = 0;
+  int i;
+
+  shard_remote_drain(&shards -> shards[home]);
+  void *addr = buddy_arena_alloc(shards -> shards[home].arena, size);
+  if(addr != NULL || size == 0){
+    return addr;
+  }
+  for (i = 0; i < shards -> n_shards; i++) {
+    drained |= shard_remote_drain(&shards -> shards[i]);
+  }
+  if(drained){
+    addr = buddy_arena_alloc(shards -> shards[home].arena, size);
+    if(addr != NULL){
+      return addr;
+    }
+  }
+  for (i = 1; i < shards -> n_shards; i++) {
+    addr = buddy_arena_alloc(shards -> shards[(home + i) % shards -> n_shards].arena, size);
+    if(addr != NULL){
+      atomic_fetch_add_explicit(&shards -> steals, 1, memory_order_relaxed);
+      return addr;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Free a block to the shard that owns it, from any thread. A block of
+ * another CPU's shard is only pushed on that shard's remote-free queue, so
+ * the free takes none of its locks and all coalescing happens in batches
+ * when the owner next allocates.
+ *
+ * @param shards sharded arena
+ * @param addr memory block address, NULL is ignored
+ */
+void buddy_shards_free(buddy_shards_t *shards, void *addr){
+  if(addr == NULL){
+    return;
+  }
+  int i = shard_of_addr(shards, addr);
+  if(i < 0){
+    return;
+  }
+  if(i == shard_of_cpu(shards)){
+    buddy_arena_free(shards -> shards[i].arena, addr);
+  }
+  else{
+    shard_remote_push(&shards -> shards[i], addr);
+  }
+}
+
+/**
+ * Free every shard's remote-free queue and return the calling thread's
+ * cached blocks to every shard, see buddy_arena_flush()
+ *
+ * @param shards sharded arena
+ */
+void buddy_shards_flush(buddy_shards_t *shards){
+  int i;
+
+  for (i = 0; i < shards -> n_shards; i++) {
+    shard_remote_drain(&shards -> shards[i]);
+    buddy_arena_flush(shards -> shards[i].arena);
+  }
+}
+
+/**
+ * Number of shards
+ */
+int buddy_shards_count(const buddy_shards_t *shards){
+  return shards -> n_shards;
+}
+
+/**
+ * Shard i, for buddy_arena_stats() and buddy_arena_dump(); it must not be
+ * destroyed on its own
+ */
+buddy_arena_t *buddy_shards_arena(buddy_shards_t *shards, int i){
+  return i >= 0 && i < shards -> n_shards ? shards -> shards[i].arena : NULL;
+}
+
+/**
+ * Number of allocations served by a shard other than the calling CPU's
+ */
+unsigned long buddy_shards_steals(const buddy_shards_t *shards){
+  return atomic_load_explicit(&shards -> steals, memory_order_relaxed);
+}
+
+/**************************************************************************
+ * Default Arena Functions
+ **************************************************************************/
+
+/**
+ * Initialize the buddy system
+ */
+void buddy_init(){
+  buddy_init_flags(0);
+}
+
+/**
+ * Initialize the buddy system with arena flags; only BUDDY_ARENA_TREE and
+ * BUDDY_ARENA_LAZY apply to the default arena
+ *
+ * @param flags BUDDY_ARENA_* flags
+ */
+void buddy_init_flags(unsigned int flags){
+  arena_init(&default_arena, g_memory, sizeof(g_memory), MIN_ORDER, MAX_ORDER,
+      g_pages, g_slack, flags & BUDDY_ARENA_TREE ? g_tree : NULL, !g_meta_used);
+  g_meta_used = 1;
+  default_arena.flags = flags & (BUDDY_ARENA_TREE | BUDDY_ARENA_LAZY);
+}
+
+/**
+ * Allocate a memory block from the default arena.
+ *
+ * @param size size in bytes
+ * @return memory block address
+ */
+void *buddy_alloc(int size){
+  if(size < 0){
+    return NULL;
+  }
+  return buddy_arena_alloc(&default_arena, size);
+}
+
+/**
+ * Free a memory block of the default arena.
+ *
+ * @param addr memory block address to be freed
+ */
+void buddy_free(void *addr){
+  buddy_arena_free(&default_arena, addr);
+}
+
+/**
+ * Print the status of the default arena.
+ */
+void buddy_dump(){
+  buddy_arena_dump(&default_arena);
+}
+
+/**
+ * Allocate exactly size bytes (rounded up to whole pages) from the default
+ * arena.
+ *
+ * @param size size in bytes
+ * @return memory address
+ */
+void *buddy_alloc_exact(int size){
+  if(size < 0){
+    return NULL;
+  }
+  return buddy_arena_alloc_exact(&default_arena, size);
+}
+
+/**
+ * Resize a memory block of the default arena.
+ *
+ * @param addr block to resize
+ * @param new_size new size in bytes
+ * @return address of the resized block
+ */
+void *buddy_realloc(void *addr, int new_size){
+  if(new_size < 0){
+    return NULL;
+  }
+  return buddy_arena_realloc(&default_arena, addr, new_size);
+}
+
+/**
+ * Allocate count blocks of size bytes from the default arena.
+ *
+ * @param size size in bytes of every block
+ * @param count number of blocks
+ * @param out receives the block addresses
+ * @return number of blocks allocated
+ */
+int buddy_alloc_bulk(int size, int count, void *out[]){
+  if(size < 0 || count < 0){
+    return 0;
+  }
+  return buddy_arena_alloc_bulk(&default_arena, size, count, out);
+}
+
+/**
+ * Free count blocks of the default arena.
+ *
+ * @param ptrs block addresses, reordered in place
+ * @param count number of blocks
+ */
+void buddy_free_bulk(void *ptrs[], int count){
+  if(count > 0){
+    buddy_arena_free_bulk(&default_arena, ptrs, count);
+  }
+}
+
+/**
+ * Read the allocator statistics of the default arena.
+ *
+ * @param stats filled in with the current statistics
+ */
+void buddy_stats(struct buddy_stats *stats){
+  buddy_arena_stats(&default_arena, stats);
+}
@@ -1,9 +1,99 @@
 #ifndef BUDDY_H
 #define BUDDY_H
 
+#include <stddef.h>
+
+/**
+ * Handle to an independently managed buddy heap
+ */
+typedef struct buddy_arena buddy_arena_t;
+
+/**
+ * Handle to a set of per-CPU arenas sharing one mapping
+ */
+typedef struct buddy_shards buddy_shards_t;
+
+/* arena flags */
+#define BUDDY_ARENA_HUGETLB  0x1 ///< map the region with MAP_HUGETLB if possible
+#define BUDDY_ARENA_HUGEPAGE 0x2 ///< advise transparent huge pages for the region
+#define BUDDY_ARENA_THREADSAFE 0x4 ///< lock the arena and cache small blocks per thread
+#define BUDDY_ARENA_LOCKFREE 0x8 ///< thread-safe with shared lock-free stacks for small orders
+#define BUDDY_ARENA_SLAB 0x10 ///< serve requests up to 2 KiB from size-class slabs
+#define BUDDY_ARENA_LAZY 0x20 ///< park freed small blocks and coalesce them in batches
+#define BUDDY_ARENA_TREE 0x40 ///< index free blocks with an implicit tree instead of free lists
+
+/**
+ * Options for buddy_arena_create_opts(). Zero means default for every field.
+ */
+struct buddy_arena_opts {
+	int min_order;       ///< log2 of the smallest block size
+	unsigned int flags;  ///< BUDDY_ARENA_* flags
+	int decommit_order;  ///< return free blocks of this order and up to the OS, 0 disables
+	int lazy_high;       ///< BUDDY_ARENA_LAZY: high watermark of the smallest order's pending list
+	int max_order;       ///< log2 of the largest block, defaults to the largest power of two in the arena
+};
+
+/* failed_allocs[] slots, one per order */
+#define BUDDY_STATS_ORDERS 64
+
+/**
+ * Allocator statistics, see buddy_arena_stats()
+ */
+struct buddy_stats {
+	unsigned long long allocs;          ///< successful allocations
+	unsigned long long frees;           ///< frees
+	unsigned long long splits;          ///< blocks split in two
+	unsigned long long merges;          ///< buddy pairs merged into one block
+	unsigned long long failed_allocs[BUDDY_STATS_ORDERS]; ///< failed allocations by order of the request
+	size_t bytes_requested;             ///< bytes asked for by the allocations currently live
+	size_t bytes_allocated;             ///< bytes handed out for them (block or object sizes)
+	double internal_fragmentation;      ///< 1 - bytes_requested / bytes_allocated, 0 if nothing is live
+	unsigned long long total_bytes_requested; ///< lifetime total of bytes asked for by all allocations
+	unsigned long long total_bytes_allocated; ///< lifetime total of bytes handed out for them
+	size_t bytes_in_use;                ///< bytes currently not on the free lists
+	size_t bytes_free;                  ///< bytes currently on the free lists
+	size_t largest_free;                ///< size of the largest free block
+	double external_fragmentation;      ///< 1 - largest_free / bytes_free, 0 if it is all one block
+};
+
+buddy_arena_t *buddy_arena_create(void *base, size_t size, int min_order);
+buddy_arena_t *buddy_arena_create_opts(void *base, size_t size,
+				       const struct buddy_arena_opts *opts);
+void buddy_arena_destroy(buddy_arena_t *arena);
+void *buddy_arena_alloc(buddy_arena_t *arena, size_t size);
+void *buddy_arena_alloc_exact(buddy_arena_t *arena, size_t size);
+void buddy_arena_free(buddy_arena_t *arena, void *addr);
+void *buddy_arena_realloc(buddy_arena_t *arena, void *addr, size_t size);
+size_t buddy_arena_alloc_bulk(buddy_arena_t *arena, size_t size, size_t count,
+			      void **out);
+void buddy_arena_free_bulk(buddy_arena_t *arena, void **addrs, size_t count);
+void buddy_arena_flush(buddy_arena_t *arena);
+void buddy_arena_dump(buddy_arena_t *arena);
+void buddy_arena_stats(buddy_arena_t *arena, struct buddy_stats *stats);
+size_t buddy_arena_usable_size(buddy_arena_t *arena, void *addr);
+int buddy_arena_owns(const buddy_arena_t *arena, const void *addr);
+
+/* per-CPU arenas, see buddy_shards_create() */
+buddy_shards_t *buddy_shards_create(size_t size, int n_shards,
+				    const struct buddy_arena_opts *opts);
+void buddy_shards_destroy(buddy_shards_t *shards);
+void *buddy_shards_alloc(buddy_shards_t *shards, size_t size);
+void buddy_shards_free(buddy_shards_t *shards, void *addr);
+void buddy_shards_flush(buddy_shards_t *shards);
+int buddy_shards_count(const buddy_shards_t *shards);
+buddy_arena_t *buddy_shards_arena(buddy_shards_t *shards, int i);
+unsigned long buddy_shards_steals(const buddy_shards_t *shards);
+
+/* default 1 MiB arena with 4 KiB pages */
 void buddy_init();
+void buddy_init_flags(unsigned int flags);
 void *buddy_alloc(int size);
+void *buddy_alloc_exact(int size);
 void buddy_free(void *addr);
+void *buddy_realloc(void *addr, int new_size);
 void buddy_dump();
+int buddy_alloc_bulk(int size, int count, void *out[]);
+void buddy_free_bulk(void *ptrs[], int count);
+void buddy_stats(struct buddy_stats *stats);
 
 #endif // BUDDY_H
@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "buddy.h"
+
+/**
+ * malloc() replacement on top of a buddy arena, built as
+ * libbuddymalloc.so for LD_PRELOAD:
+ *
+ *     LD_PRELOAD=./libbuddymalloc.so ./service
+ *
+ * Every request is served by one thread-safe slab arena, mapped lazily on
+ * first use (BUDDY_MALLOC_ARENA_SIZE bytes, default 4 GiB of address space)
+ * and returning fully coalesced blocks of 1 MiB and up to the OS. Requests
+ * the arena cannot hold, because they exceed its largest block or it is
+ * exhausted, get their own mapping with a header just below the returned
+ * address. Frees tell the two apart by address range, and sizes come from
+ * the arena's page metadata, so neither needs a per-allocation header.
+ *
+ * Known limitations: no fork handlers, so a child forked while another
+ * thread holds the arena lock must not allocate. And slab objects are not
+ * cached per thread: every malloc() and free() of 2 KiB or less takes the
+ * arena mutex, so small allocations from many threads serialize on it.
+ * Only blocks of 4 to 32 KiB go through the per-thread magazines.
+ */
+
+#define ARENA_SIZE (1ul << 32)  ///< default size of the arena
+#define PAGE_ORDER 12           ///< log2 of the arena page size
+#define DECOMMIT_ORDER 20       ///< free blocks from this order up are returned to the OS
+#define SLAB_ALIGN 64           ///< slab objects are aligned to min(size class, 64)
+#define BIG_HEADER 4096         ///< room reserved for the header of a mapped request
+
+/**
+ * Header just below the address of a request served by its own mapping
+ */
+typedef struct big_t {
+	void* map;     ///< start of the mapping
+	size_t len;    ///< length of the mapping
+	size_t usable; ///< bytes usable from the returned address
+} big_t;
+
+static buddy_arena_t* arena;
+static size_t arena_size;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Map the arena; on failure everything is served by mappings
+ */
+static void arena_setup(void)
+{
+	struct buddy_arena_opts opts = {
+		.min_order = PAGE_ORDER,
+		.flags = BUDDY_ARENA_THREADSAFE | BUDDY_ARENA_SLAB,
+		.decommit_order = DECOMMIT_ORDER,
+	};
+	const char* env = getenv("BUDDY_MALLOC_ARENA_SIZE");
+	size_t size = ARENA_SIZE;
+
+	if (env != NULL) {
+		size_t want = strtoull(env, NULL, 0);
+
+		// Any whole number of pages, not just a power of two
+		size = want & ~(((size_t)1 << PAGE_ORDER) - 1);
+		if (size < ((size_t)1 << (PAGE_ORDER + 1)))
+			size = (size_t)1 << (PAGE_ORDER + 1);
+		if (size > ((size_t)1 << 46))
+			size = (size_t)1 << 46;
+	}
+
+	arena = buddy_arena_create_opts(NULL, size, &opts);
+	arena_size = arena != NULL ? size : 0;
+}
+
+static inline buddy_arena_t* get_arena(void)
+{
+	pthread_once(&arena_once, arena_setup);
+	return arena;
+}
+
+static inline big_t* big_header(void* addr)
+{
+	return (big_t*)addr - 1;
+}
+
+/**
+ * Serve a request from its own mapping
+ *
+ * @param size Requested bytes
+ * @param align Required alignment, a power of two, or 0
+ * @return The memory (zeroed), or NULL if out of memory
+ */
+static void* big_alloc(size_t size, size_t align)
+{
+	size_t pad = align > BIG_HEADER ? align : 0;
+
+	if (size > SIZE_MAX - BIG_HEADER - pad) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size_t len = (BIG_HEADER + size + pad + BIG_HEADER - 1) & ~(size_t)(BIG_HEADER - 1);
+	char* map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (map == MAP_FAILED) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	char* addr = map + BIG_HEADER;
+
+	if (pad != 0)
+		addr = (char*)(((uintptr_t)addr + align - 1) & ~(uintptr_t)(align - 1));
+
+	big_t* hdr = big_header(addr);
+
+	hdr->map = map;
+	hdr->len = len;
+	hdr->usable = map + len - addr;
+
+	return addr;
+}
+
+static void big_free(void* addr)
+{
+	big_t* hdr = big_header(addr);
+
+	munmap(hdr->map, hdr->len);
+}
+
+/**
+ * Allocate from the arena, or from a mapping if the arena cannot
+ *
+ * Alignments up to SLAB_ALIGN are met by rounding small requests up to a
+ * size class of at least the alignment; larger ones by taking a whole
+ * buddy block, which is aligned to its own size.
+ *
+ * @param size Requested bytes
+ * @param align Required alignment, a power of two, or 0
+ */
+static void* shim_alloc(size_t size, size_t align)
+{
+	buddy_arena_t* a = get_arena();
+	size_t want = size ? size : 1;
+
+	if (align > SLAB_ALIGN) {
+		if (want < align)
+			want = align;
+		if (want < ((size_t)1 << PAGE_ORDER))
+			want = (size_t)1 << PAGE_ORDER;
+	}
+	else if (want < align) {
+		want = align;
+	}
+
+	if (a != NULL && want <= arena_size) {
+		void* addr = buddy_arena_alloc(a, want);
+
+		if (addr != NULL)
+			return addr;
+	}
+
+	return big_alloc(size, align);
+}
+
+static inline size_t usable_size(void* addr)
+{
+	if (arena != NULL && buddy_arena_owns(arena, addr))
+		return buddy_arena_usable_size(arena, addr);
+	return big_header(addr)->usable;
+}
+
+void* malloc(size_t size)
+{
+	return shim_alloc(size, 0);
+}
+
+void free(void* addr)
+{
+	if (addr == NULL)
+		return;
+
+	if (arena != NULL && buddy_arena_owns(arena, addr))
+		buddy_arena_free(arena, addr);
+	else
+		big_free(addr);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void* addr = shim_alloc(total, 0);
+
+	// Fresh mappings are already zero
+	if (addr != NULL && arena != NULL && buddy_arena_owns(arena, addr))
+		memset(addr, 0, total);
+
+	return addr;
+}
+
+void* realloc(void* addr, size_t size)
+{
+	if (addr == NULL)
+		return malloc(size);
+	if (size == 0) {
+		free(addr);
+		return NULL;
+	}
+
+	size_t old = usable_size(addr);
+
+	if (arena != NULL && buddy_arena_owns(arena, addr)) {
+		// Resized in place where the buddies allow, moved otherwise
+		void* moved = size <= arena_size ? buddy_arena_realloc(arena, addr, size) : NULL;
+
+		if (moved != NULL)
+			return moved;
+	}
+	else if (size <= old) {
+		return addr;
+	}
+	else {
+		big_t* hdr = big_header(addr);
+
+		// A mapping whose header fills its first page can simply grow
+		if ((char*)addr == (char*)hdr->map + BIG_HEADER && size <= SIZE_MAX - 2 * BIG_HEADER) {
+			size_t len = (BIG_HEADER + size + BIG_HEADER - 1) & ~(size_t)(BIG_HEADER - 1);
+			char* map = mremap(hdr->map, hdr->len, len, MREMAP_MAYMOVE);
+
+			if (map != MAP_FAILED) {
+				hdr = (big_t*)(map + BIG_HEADER) - 1;
+				hdr->map = map;
+				hdr->len = len;
+				hdr->usable = len - BIG_HEADER;
+				return map + BIG_HEADER;
+			}
+		}
+	}
+
+	void* moved = shim_alloc(size, 0);
+
+	if (moved == NULL)
+		return NULL;
+	memcpy(moved, addr, old < size ? old : size);
+	free(addr);
+
+	return moved;
+}
+
+void* reallocarray(void* addr, size_t nmemb, size_t size)
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(addr, total);
+}
+
+int posix_memalign(void** memptr, size_t align, size_t size)
+{
+	if (align < sizeof(void*) || (align & (align - 1)) != 0)
+		return EINVAL;
+
+	void* addr = shim_alloc(size, align);
+
+	if (addr == NULL)
+		return ENOMEM;
+	*memptr = addr;
+	return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size)
+{
+	if (align == 0 || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return shim_alloc(size, align);
+}
+
+void* memalign(size_t align, size_t size)
+{
+	return aligned_alloc(align, size);
+}
+
+void* valloc(size_t size)
+{
+	return shim_alloc(size, (size_t)1 << PAGE_ORDER);
+}
+
+void* pvalloc(size_t size)
+{
+	size_t page = (size_t)1 << PAGE_ORDER;
+
+	return shim_alloc((size + page - 1) & ~(page - 1), page);
+}
+
+size_t malloc_usable_size(void* addr)
+{
+	return addr != NULL ? usable_size(addr) : 0;
+}
@@ -10,12 +10,17 @@ SUCCESSFUL_TESTS=""
 FAILED_TESTS=""
 UNCHECKED_TESTS=""
 
+# Every fixture runs on both free block engines, which must print the same
+ENGINES="list tree"
+
 for F in `find $TEST_DIR -type f -name test_'*' | sort`
+do
+for ENGINE in $ENGINES
 do
     echo "-----------------------------------------------------------"
-    echo "Running test: $F"
+    echo "Running test: $F ($ENGINE engine)"
 
-    ./buddy -i $F > $TMP_FILE
+    ./buddy -e $ENGINE -i $F > $TMP_FILE
 
     # cat $TMP_FILE # Uncomment this line to output run results
 
@@ -29,19 +34,20 @@ do
 
 	if [ "$DIFF_OUT" != "" ]; then
 	    echo "$DIFF_OUT"
-	    echo "Output from test $F differs"
-	    FAILED_TESTS+=" $F"
+	    echo "Output from test $F ($ENGINE engine) differs"
+	    FAILED_TESTS+=" $F:$ENGINE"
 	else
 	    echo "Test passed"
-	    SUCCESSFUL_TESTS+=" $F"
+	    SUCCESSFUL_TESTS+=" $F:$ENGINE"
 	fi
     else
 	echo "No result file for test: $F... Skipping diff"
-	UNCHECKED_TESTS+=" $F"
+	UNCHECKED_TESTS+=" $F:$ENGINE"
     fi
 
     echo ""
 done
+done
 
 rm $TMP_FILE
 
@@ -1,13 +1,20 @@
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "buddy.h"
+#include "trace.h"
 
 /**
  * Various program statuses indicating success or failure of an operation
@@ -37,24 +44,68 @@ typedef struct var_t {
 } var_t;
 
 
-static FILE *in = NULL;    // Input file
-static var_t var_map[256]; // Keep track of variable allocations
-static int linenum = 0;    // Line number in input file
+static FILE *in = NULL;     // Input file
+static trace_names_t names; // Variable names to dense variable ids
+static var_t* vars = NULL;  // Keep track of variable allocations by id
+static size_t nvars = 0;    // Number of entries in vars
+static long linenum = 0;    // Line number in input file
+static buddy_arena_t* arena = NULL; // Arena the commands run on
 
+#define ARENA_SIZE (1ul << 20) // default arena size, that of the buddy_alloc() arena
+#define ARENA_PAGE_ORDER 12    // default log2 of the page size
+
+#define OUT_BUFSIZE (1 << 20) // stdout buffer, the dumps are most of the output
+static char out_buf[OUT_BUFSIZE];
+
+
+/**
+ * Make room for the variables with ids below n
+ *
+ * @param n Number of variables needed
+ * @return Returns false if out of memory
+ */
+static bool reserve_vars(size_t n)
+{
+	if (n <= nvars)
+		return true;
+
+	size_t cap = nvars ? nvars : 256;
+
+	while (cap < n)
+		cap *= 2;
+
+	var_t* grown = realloc(vars, cap * sizeof(var_t));
+
+	if (grown == NULL)
+		return false;
+	memset(grown + nvars, 0, (cap - nvars) * sizeof(var_t));
+	vars = grown;
+	nvars = cap;
+
+	return true;
+}
 
 /**
  * Resolve a variable by name
  *
- * @param var Name of variable
+ * Any number of variables can be live: names are mapped to dense ids by a
+ * hash table and the ids index a growing array.
+ *
+ * @param name Name of variable (letters, digits and underscores), which
+ * need not be NUL terminated
+ * @param len Length of the name
  * @return Returns a pointer to location of the variable's
- * representation. Returns NULL if the var is not an alphabetic character.
+ * representation. Returns NULL if the name is empty or out of memory.
  */
-static var_t* get_var(char var)
+static var_t* get_var(const char* name, size_t len)
 {
-	if ((var >= 'a' && var <= 'z') || (var >= 'A' && var <= 'Z'))
-		return &var_map[(int) var];
-	else
+	uint32_t id;
+
+	if (len == 0 || (id = trace_name_id(&names, name, len)) == TRACE_NO_ID ||
+	    !reserve_vars((size_t)id + 1))
 		return NULL;
+
+	return &vars[id];
 }
 
 /**
@@ -79,7 +130,7 @@ static void print_fault(const char* cmd, const char* msg, severity_t sev)
 		severity_msg = "?????";
 	}
 
-	fprintf(stderr, "%s: Line %d: %s\n", severity_msg, linenum, msg);
+	fprintf(stderr, "%s: Line %ld: %s\n", severity_msg, linenum, msg);
 	fprintf(stderr, "    Faulting Command: %s\n", cmd);
 }
 
@@ -95,24 +146,94 @@ static status_t parse_error(const char* cmd)
 	return BADINPUT;
 }
 
+/**
+ * Allocate a block for a variable
+ *
+ * @param var Variable to assign the block to
+ * @param size Size of the block in bytes
+ * @param exact Allocate with buddy_arena_alloc_exact() instead of
+ * buddy_arena_alloc()
+ * @return SUCCESS, or OUTOFMEMORY if the allocator returned NULL
+ */
+static status_t exec_alloc(var_t* var, int size, bool exact)
+{
+	if (size < 0)
+		var->mem = NULL;
+	else
+		var->mem = exact ? buddy_arena_alloc_exact(arena, size) :
+				   buddy_arena_alloc(arena, size);
+
+	if (var->mem == NULL)
+		return OUTOFMEMORY;
+
+	var->in_use = true;
+
+	return SUCCESS;
+}
+
+/**
+ * Free the block of a variable
+ *
+ * @param var Variable whose block is freed
+ * @return SUCCESS, or DOUBLEFREE if the variable holds no block
+ */
+static status_t exec_free(var_t* var)
+{
+	// Ensure that the variable is in use
+	if (!var->in_use)
+		return DOUBLEFREE;
+
+	buddy_arena_free(arena, var->mem);
+	var->mem = NULL;
+	var->in_use = false;
+
+	return SUCCESS;
+}
+
+/**
+ * Print the fault message of a failed command
+ *
+ * @param cmd A string representing the command
+ * @param status Status the command was executed with
+ * @return Returns status
+ */
+static status_t report_status(const char* cmd, status_t status)
+{
+	switch (status) {
+	case OUTOFMEMORY:
+		print_fault(cmd, "buddy_alloc returned NULL", WARNING);
+		printf("Out of memory\n");
+		break;
+	case DOUBLEFREE:
+		print_fault(cmd, "Double free", ERROR);
+		break;
+	default:
+		break;
+	}
+
+	return status;
+}
+
 /**
  * Parses an allocation instruction
  *
  * @param cmd String representing an allocation command in the program
+ * @param exact Parse alloc_exact() and allocate with buddy_arena_alloc_exact()
  * @returns Status of read and execute
  */
-static status_t parse_alloc(char* cmd)
+static status_t parse_alloc(char* cmd, bool exact)
 {
 	assert(cmd != NULL);
 	assert(cmd[0] != '\0');
 
-	char var_name;
+	char var_name[strlen(cmd) + 1];
 	int size;
 	char alter_size;
 	int matched;
 
 	errno = 0;
-	matched = sscanf(cmd, "%c=alloc(%d%c)", &var_name, &size, &alter_size);
+	matched = sscanf(cmd, exact ? "%[A-Za-z0-9_]=alloc_exact(%d%c)" : "%[A-Za-z0-9_]=alloc(%d%c)",
+			 var_name, &size, &alter_size);
 
 	// Error check sprintf
 	if (matched == 3 && errno == 0) {
@@ -132,23 +253,12 @@ static status_t parse_alloc(char* cmd)
 	}
 
 	// Resolve variable
-	var_t* var = get_var(var_name);
+	var_t* var = get_var(var_name, strlen(var_name));
 
 	if (var == NULL)
 		return parse_error(cmd);
 
-	// Allocate variable
-	var->mem = buddy_alloc(size);
-
-	if (var->mem == NULL) {
-		print_fault(cmd, "buddy_alloc returned NULL", WARNING);
-		printf("Out of memory\n");
-		return OUTOFMEMORY;
-	}
-
-	var->in_use = true;
-
-	return SUCCESS;
+	return report_status(cmd, exec_alloc(var, size, exact));
 }
 
 /**
@@ -161,30 +271,21 @@ static status_t parse_free(char* cmd)
 {
 	assert(cmd != NULL);
 
-	char var_name;
+	char var_name[strlen(cmd) + 1];
+	char close;
 	int matched;
 	var_t* var;
 
 	// Read the command string
 	errno = 0;
-	matched = sscanf(cmd, "free(%c)", &var_name);
+	matched = sscanf(cmd, "free(%[A-Za-z0-9_]%c", var_name, &close);
 
 	// Check if sscanf was valid
-	if (matched != 1 || errno != 0 || (var = get_var(var_name)) == NULL)
+	if (matched != 2 || errno != 0 || close != ')' ||
+	    (var = get_var(var_name, strlen(var_name))) == NULL)
 		return parse_error(cmd);
 
-	// Ensure that the variable is in use
-	if (!var->in_use) {
-		print_fault(cmd, "Double free", ERROR);
-		return DOUBLEFREE;
-	}
-
-	// Free variable
-	buddy_free(var->mem);
-	var->mem = NULL;
-	var->in_use = false;
-
-	return SUCCESS;
+	return report_status(cmd, exec_free(var));
 }
 
 
@@ -221,11 +322,14 @@ static status_t parse_command(char* cmd, int cmd_len)
 
 	status_t status;
 
-	// We have 2 commands: alloc and free.
-	if (strstr(cmd, "alloc") != NULL)
-		status = parse_alloc(cmd);
-	else if (strstr(cmd, "free") != NULL)
+	// We have 3 commands: alloc, alloc_exact and free. A variable may be
+	// called free, so only free( starts a free.
+	if (strncmp(cmd, "free(", 5) == 0)
 		status = parse_free(cmd);
+	else if (strstr(cmd, "=alloc_exact(") != NULL)
+		status = parse_alloc(cmd, true);
+	else if (strstr(cmd, "=alloc(") != NULL)
+		status = parse_alloc(cmd, false);
 	else
 		return parse_error(cmd);
 
@@ -233,7 +337,7 @@ static status_t parse_command(char* cmd, int cmd_len)
 		return status;
 
 	// Output free blocks
-	buddy_dump();
+	buddy_arena_dump(arena);
 
 	return SUCCESS;
 }
@@ -259,6 +363,273 @@ static status_t parse_file()
 	return status;
 }
 
+/**
+ * Report a fault on a line of a mapped trace file
+ *
+ * The line is not NUL terminated, so it is copied (and truncated if
+ * needed) for the message.
+ *
+ * @param line Start of the line
+ * @param eol End of the line
+ * @param status Status to report, BADINPUT for a parse error
+ * @return Returns status
+ */
+static status_t replay_fault(const char* line, const char* eol, status_t status)
+{
+	char cmd[256];
+	size_t len = eol - line;
+
+	if (len >= sizeof(cmd))
+		len = sizeof(cmd) - 1;
+	memcpy(cmd, line, len);
+	cmd[len] = '\0';
+
+	if (status == BADINPUT)
+		return parse_error(cmd);
+	return report_status(cmd, status);
+}
+
+/**
+ * Execute one line of a mapped trace file without copying it
+ *
+ * @param line Start of the line
+ * @param eol End of the line
+ * @param executed Set if the line held a command
+ * @return Program status.
+ */
+static status_t replay_line(const char* line, const char* eol, bool* executed)
+{
+	trace_cmd_t cmd;
+	var_t* var;
+	status_t status;
+	int parsed = trace_parse_line(line, eol, &cmd);
+
+	*executed = parsed > 0;
+	if (parsed == 0)
+		return SUCCESS;
+	if (parsed < 0 || (var = get_var(cmd.name, cmd.name_len)) == NULL)
+		return replay_fault(line, eol, BADINPUT);
+
+	if (cmd.op == TRACE_FREE)
+		status = exec_free(var);
+	else
+		status = exec_alloc(var, cmd.size, cmd.op == TRACE_ALLOC_EXACT);
+
+	return status == SUCCESS ? status : replay_fault(line, eol, status);
+}
+
+/**
+ * Map a whole input file for replay
+ *
+ * @param fd Descriptor of the input, which must be a regular file
+ * @param size Set to the size of the file
+ * @return Start of the mapping, NULL for an empty file or MAP_FAILED
+ */
+static const char* map_input(int fd, size_t* size)
+{
+	struct stat st;
+	void* data;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "ERROR: Replay needs a regular input file\n");
+		return MAP_FAILED;
+	}
+	*size = st.st_size;
+	if (st.st_size == 0)
+		return NULL;
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("ERROR: Failed to map input file");
+		return MAP_FAILED;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	return data;
+}
+
+/**
+ * Seconds elapsed since start on the monotonic clock
+ */
+static double seconds_since(const struct timespec* start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Print the throughput of a replay
+ */
+static void print_throughput(long ops, double elapsed)
+{
+	printf("Replayed %ld ops in %.3f s (%.0f ops/sec)\n",
+	       ops, elapsed, elapsed > 0 ? ops / elapsed : 0);
+}
+
+/**
+ * Replay a text trace file at full speed
+ *
+ * The file is mapped and scanned in place instead of being read line by
+ * line, and the free lists are only dumped on request. The throughput is
+ * printed when the replay ends.
+ *
+ * @param fd Descriptor of the trace file, which must be a regular file
+ * @param dump_every Dump the free lists every this many commands, 0 for never
+ * @param dump_end Dump the free lists once the replay ends
+ * @return Program status.
+ */
+static status_t replay_file(int fd, long dump_every, bool dump_end)
+{
+	size_t size;
+	const char* data = map_input(fd, &size);
+
+	if (data == MAP_FAILED)
+		return BADINPUT;
+
+	const char* p = data;
+	const char* end = data + size;
+	status_t status = SUCCESS;
+	long ops = 0;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (status == SUCCESS && p < end) {
+		const char* eol = memchr(p, '\n', end - p);
+		bool executed;
+
+		if (eol == NULL)
+			eol = end;
+		++linenum;
+		status = replay_line(p, eol, &executed);
+		if (executed && status == SUCCESS) {
+			++ops;
+			if (dump_every > 0 && ops % dump_every == 0)
+				buddy_arena_dump(arena);
+		}
+		p = eol + 1;
+	}
+
+	double elapsed = seconds_since(&start);
+
+	if (dump_end)
+		buddy_arena_dump(arena);
+	print_throughput(ops, elapsed);
+
+	if (data != NULL)
+		munmap((void*)data, size);
+
+	return status;
+}
+
+/**
+ * Report a fault on a record of a binary trace
+ *
+ * @param rec Faulting record
+ * @param status Status to report, BADINPUT for a malformed record
+ * @return Returns status
+ */
+static status_t binary_fault(const struct trace_record* rec, status_t status)
+{
+	char cmd[64];
+
+	if (trace_record_op(rec) == TRACE_FREE)
+		snprintf(cmd, sizeof(cmd), "free(#%u)", trace_record_handle(rec));
+	else
+		snprintf(cmd, sizeof(cmd), "#%u = %s(%u)", trace_record_handle(rec),
+			 trace_record_op(rec) == TRACE_ALLOC_EXACT ? "alloc_exact" : "alloc",
+			 rec->size);
+
+	if (status == BADINPUT)
+		return parse_error(cmd);
+	return report_status(cmd, status);
+}
+
+/**
+ * Replay a binary trace file at full speed
+ *
+ * Records go straight to the arena built from -a, -p and -f; handle ids
+ * index the variable array directly, sized from the header. Faults report
+ * the record number in place of a line number.
+ *
+ * @param fd Descriptor of the trace file, which must be a regular file
+ * @param dump_every Dump the free lists every this many records, 0 for never
+ * @param dump_end Dump the free lists once the replay ends
+ * @return Program status.
+ */
+static status_t replay_binary(int fd, long dump_every, bool dump_end)
+{
+	size_t size;
+	const char* data = map_input(fd, &size);
+
+	if (data == MAP_FAILED)
+		return BADINPUT;
+
+	const struct trace_header* hdr = (const struct trace_header*)data;
+	size_t rec_size;
+
+	if (data == NULL || size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != TRACE_VERSION ||
+	    (size - sizeof(*hdr)) / (rec_size = trace_record_size(hdr)) < hdr->count) {
+		fprintf(stderr, "ERROR: Not a binary trace or truncated\n");
+		if (data != NULL)
+			munmap((void*)data, size);
+		return BADINPUT;
+	}
+
+	if (!reserve_vars(hdr->handles)) {
+		fprintf(stderr, "ERROR: No memory for %llu handles\n",
+			(unsigned long long)hdr->handles);
+		munmap((void*)data, size);
+		return BADINPUT;
+	}
+
+	const char* p = data + sizeof(*hdr);
+	status_t status = SUCCESS;
+	long ops = 0;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (uint64_t i = 0; status == SUCCESS && i < hdr->count; ++i, p += rec_size) {
+		const struct trace_record* rec = (const struct trace_record*)p;
+		trace_op_t op = trace_record_op(rec);
+		uint32_t handle = trace_record_handle(rec);
+
+		linenum = i + 1;
+		if (handle >= hdr->handles)
+			status = BADINPUT;
+		else if (op == TRACE_FREE)
+			status = exec_free(&vars[handle]);
+		else if ((op == TRACE_ALLOC || op == TRACE_ALLOC_EXACT) && rec->size <= INT_MAX)
+			status = exec_alloc(&vars[handle], rec->size, op == TRACE_ALLOC_EXACT);
+		else
+			status = BADINPUT;
+
+		if (status != SUCCESS) {
+			binary_fault(rec, status);
+		}
+		else {
+			++ops;
+			if (dump_every > 0 && ops % dump_every == 0)
+				buddy_arena_dump(arena);
+		}
+	}
+
+	double elapsed = seconds_since(&start);
+
+	if (dump_end)
+		buddy_arena_dump(arena);
+	print_throughput(ops, elapsed);
+
+	munmap((void*)data, size);
+
+	return status;
+}
+
 
 /**
  * Output program manual
@@ -269,31 +640,125 @@ static status_t parse_file()
 void print_usage(char* prog_name, FILE* out)
 {
 	fprintf(out, "Usage:\n");
-	fprintf(out, "  ./%s [-i filename]\n", prog_name);
+	fprintf(out, "  ./%s [-i filename] [-e engine] [-a size] [-p order] [-f flags]\n", prog_name);
+	fprintf(out, "     [-r | -b [-d n] [-D]]\n");
 	fprintf(out, "     -i [optional] - Specify an input file name to read from. If this option \n");
 	fprintf(out, "                     is not used then input is expected from standard input.\n");
+	fprintf(out, "     -e [optional] - Allocator engine: list (free lists, default) or tree\n");
+	fprintf(out, "                     (implicit buddy tree).\n");
+	fprintf(out, "     -a [optional] - Arena size in bytes, with an optional K, M or G suffix\n");
+	fprintf(out, "                     (default 1M). Replaying real traces needs far more.\n");
+	fprintf(out, "     -p [optional] - log2 of the arena page size (default 12).\n");
+	fprintf(out, "     -f [optional] - BUDDY_ARENA_* flags of the arena (default 0).\n");
+	fprintf(out, "     -r [optional] - Replay the input at full speed without dumping the free\n");
+	fprintf(out, "                     lists and report the throughput. The input must be a file.\n");
+	fprintf(out, "     -b [optional] - Like -r for a binary trace made by trace_convert,\n");
+	fprintf(out, "                     on the same arena (-a, -p, -f).\n");
+	fprintf(out, "     -d [optional] - With -r or -b, dump the free lists every n commands.\n");
+	fprintf(out, "     -D [optional] - With -r or -b, dump the free lists once at the end.\n");
+}
+
+/**
+ * Parse a byte count with an optional K, M or G suffix
+ *
+ * @param arg Command line argument
+ * @return The byte count, or 0 if arg is not one
+ */
+static size_t parse_bytes(const char* arg)
+{
+	char* end;
+	size_t bytes = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'G': case 'g':
+		bytes <<= 10;
+		// fall through
+	case 'M': case 'm':
+		bytes <<= 10;
+		// fall through
+	case 'K': case 'k':
+		bytes <<= 10;
+		++end;
+		break;
+	}
+	return *end == '\0' ? bytes : 0;
 }
 
 int main(int argc, char** argv)
 {
 	int opt;
+	bool replay = false;
+	bool binary = false;
+	long dump_every = 0;
+	bool dump_end = false;
+	size_t arena_size = ARENA_SIZE;
+	struct buddy_arena_opts opts = { .min_order = ARENA_PAGE_ORDER };
 
 	status_t prog_status;
 
 	in = stdin;
 
 	// Parse command line options
-	while ((opt = getopt(argc, argv, "i:")) != -1) {
+	while ((opt = getopt(argc, argv, "i:e:a:p:f:rbd:D")) != -1) {
 		switch (opt) {
 		case 'i':
 			in = fopen(optarg, "r");
 			break;
 
+		case 'e':
+			if (strcmp(optarg, "tree") == 0) {
+				opts.flags |= BUDDY_ARENA_TREE;
+			}
+			else if (strcmp(optarg, "list") != 0) {
+				print_usage(argv[0], stderr);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 'a':
+			arena_size = parse_bytes(optarg);
+			break;
+
+		case 'p':
+			opts.min_order = atoi(optarg);
+			break;
+
+		case 'f':
+			opts.flags |= strtoul(optarg, NULL, 0);
+			break;
+
+		case 'r':
+			replay = true;
+			break;
+
+		case 'b':
+			binary = true;
+			break;
+
+		case 'd':
+			dump_every = atol(optarg);
+			break;
+
+		case 'D':
+			dump_end = true;
+			break;
+
 		case '?':
 			switch (optopt) {
 			case 'i':
 				fprintf(stderr, "ERROR: Missing filename after '%c'", optopt);
 				return EXIT_FAILURE;
+			case 'd':
+				fprintf(stderr, "ERROR: Missing count after '%c'", optopt);
+				return EXIT_FAILURE;
+			case 'e':
+				fprintf(stderr, "ERROR: Missing engine after '%c'", optopt);
+				return EXIT_FAILURE;
+			case 'a':
+			case 'p':
+			case 'f':
+				fprintf(stderr, "ERROR: Missing value after '%c'", optopt);
+				return EXIT_FAILURE;
 			}
 
 			print_usage(argv[0], stdout);
@@ -307,15 +772,33 @@ int main(int argc, char** argv)
 		return EXIT_FAILURE;
 	}
 
-	// Zero memory
-	memset(var_map, 0, sizeof(var_map));
+	// One dump per command: write it out in large blocks unless someone is
+	// watching
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+	arena = buddy_arena_create_opts(NULL, arena_size, &opts);
+	if (arena == NULL) {
+		fprintf(stderr, "ERROR: Failed to create a %zu byte arena with %d byte pages\n",
+			arena_size, 1 << opts.min_order);
+		return EXIT_FAILURE;
+	}
+
+	trace_names_init(&names);
 
 	// Execute program
-	buddy_init();
-	prog_status = parse_file();
+	if (binary)
+		prog_status = replay_binary(fileno(in), dump_every, dump_end);
+	else if (replay)
+		prog_status = replay_file(fileno(in), dump_every, dump_end);
+	else
+		prog_status = parse_file();
 
 	if (in != stdin)
 		fclose(in);
+	trace_names_free(&names);
+	free(vars);
+	buddy_arena_destroy(arena);
 
 	if (prog_status == SUCCESS)
 		return EXIT_SUCCESS;
@@ -0,0 +1,259 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/**
+ * Skip blanks within a line
+ */
+static inline const char* skip_blanks(const char* p, const char* eol)
+{
+	while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r'))
+		++p;
+	return p;
+}
+
+/**
+ * Match a keyword followed by optional blanks
+ *
+ * @return Position after the keyword and blanks, or NULL if it does not match
+ */
+static inline const char* scan_word(const char* p, const char* eol,
+				    const char* word, size_t len)
+{
+	if ((size_t)(eol - p) < len || memcmp(p, word, len) != 0)
+		return NULL;
+	return skip_blanks(p + len, eol);
+}
+
+/**
+ * Is c allowed in a handle name
+ */
+static inline int is_name_char(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(c >= '0' && c <= '9') || c == '_';
+}
+
+/**
+ * Match a handle name followed by optional blanks
+ *
+ * @return Position after the name and blanks, or NULL if there is no name
+ */
+static inline const char* scan_name(const char* p, const char* eol, trace_cmd_t* cmd)
+{
+	const char* start = p;
+
+	while (p < eol && is_name_char(*p))
+		++p;
+	if (p == start)
+		return NULL;
+	cmd->name = start;
+	cmd->name_len = p - start;
+	return skip_blanks(p, eol);
+}
+
+/**
+ * Parse one line of a text trace in place
+ *
+ * Accepts `X = alloc(size)`, `X = alloc_exact(size)` and `free(X)` with
+ * blanks between tokens, where X is a handle name of letters, digits and
+ * underscores and size is a decimal byte count optionally followed by K
+ * for KiB and at most INT_MAX bytes.
+ *
+ * @param line Start of the line, which need not be NUL terminated
+ * @param eol End of the line (the newline or the end of the input)
+ * @param cmd Filled in with the parsed command
+ * @return 1 for a command, 0 for a blank line and -1 for a parse error
+ */
+int trace_parse_line(const char* line, const char* eol, trace_cmd_t* cmd)
+{
+	const char* p = skip_blanks(line, eol);
+
+	cmd->op = TRACE_NONE;
+	cmd->size = 0;
+	if (p == eol)
+		return 0;
+
+	const char* q = scan_word(p, eol, "free", 4);
+
+	// free( starts a free, a handle may still be called free
+	if (q != NULL && (q = scan_word(q, eol, "(", 1)) != NULL) {
+		if ((p = scan_name(q, eol, cmd)) == NULL ||
+		    scan_word(p, eol, ")", 1) != eol)
+			return -1;
+		cmd->op = TRACE_FREE;
+		return 1;
+	}
+
+	if ((p = scan_name(p, eol, cmd)) == NULL ||
+	    (p = scan_word(p, eol, "=", 1)) == NULL ||
+	    (p = scan_word(p, eol, "alloc", 5)) == NULL)
+		return -1;
+
+	q = scan_word(p, eol, "_exact", 6);
+
+	cmd->op = q != NULL ? TRACE_ALLOC_EXACT : TRACE_ALLOC;
+	if (q != NULL)
+		p = q;
+	if ((p = scan_word(p, eol, "(", 1)) == NULL || p == eol ||
+	    *p < '0' || *p > '9')
+		return -1;
+
+	uint64_t size = 0;
+
+	while (p < eol && *p >= '0' && *p <= '9') {
+		size = size * 10 + (*p++ - '0');
+		if (size > INT_MAX)
+			return -1;
+	}
+	p = skip_blanks(p, eol);
+	if (p < eol && (*p == 'k' || *p == 'K')) {
+		size *= 1024;
+		p = skip_blanks(p + 1, eol);
+	}
+	if (scan_word(p, eol, ")", 1) != eol || size > INT_MAX)
+		return -1;
+
+	cmd->size = size;
+	return 1;
+}
+
+/**
+ * Size of one record of a binary trace
+ *
+ * @param hdr Header of the trace
+ * @return Record size in bytes
+ */
+size_t trace_record_size(const struct trace_header* hdr)
+{
+	return hdr->flags & TRACE_TIMESTAMPS ?
+		sizeof(struct trace_record_ts) : sizeof(struct trace_record);
+}
+
+/**
+ * Hash a handle name (FNV-1a with a final mix, so sequential numeric names
+ * spread over the table)
+ */
+static uint32_t name_hash(const char* name, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
+
+/**
+ * Create an empty name table
+ *
+ * @param t Table to initialize
+ */
+void trace_names_init(trace_names_t* t)
+{
+	memset(t, 0, sizeof(*t));
+}
+
+/**
+ * Release the memory of a name table
+ *
+ * @param t Table to release
+ */
+void trace_names_free(trace_names_t* t)
+{
+	free(t->slots);
+	free(t->names);
+	free(t->pool);
+	trace_names_init(t);
+}
+
+/**
+ * Double the hash table and reinsert every id from its stored hash
+ */
+static int names_rehash(trace_names_t* t)
+{
+	size_t nslots = t->nslots ? 2 * t->nslots : 64;
+	uint32_t* slots = calloc(nslots, sizeof(uint32_t));
+
+	if (slots == NULL)
+		return -1;
+
+	for (uint32_t id = 0; id < t->count; ++id) {
+		size_t i = t->names[id].hash & (nslots - 1);
+
+		while (slots[i] != 0)
+			i = (i + 1) & (nslots - 1);
+		slots[i] = id + 1;
+	}
+
+	free(t->slots);
+	t->slots = slots;
+	t->nslots = nslots;
+	return 0;
+}
+
+/**
+ * Look up the id of a handle name, assigning the next id on first use
+ *
+ * @param t Name table
+ * @param name Name, which need not be NUL terminated
+ * @param len Length of the name
+ * @return The dense id of the name, or TRACE_NO_ID if out of memory or ids
+ */
+uint32_t trace_name_id(trace_names_t* t, const char* name, size_t len)
+{
+	uint32_t hash = name_hash(name, len);
+
+	if (t->nslots != 0) {
+		size_t i = hash & (t->nslots - 1);
+
+		for (; t->slots[i] != 0; i = (i + 1) & (t->nslots - 1)) {
+			const trace_name_t* n = &t->names[t->slots[i] - 1];
+
+			if (n->hash == hash && n->len == len &&
+			    memcmp(t->pool + n->off, name, len) == 0)
+				return t->slots[i] - 1;
+		}
+	}
+
+	if (t->count == TRACE_NO_ID - 1 || len > UINT32_MAX)
+		return TRACE_NO_ID;
+	if (2 * ((size_t)t->count + 1) > t->nslots && names_rehash(t) != 0)
+		return TRACE_NO_ID;
+	if (t->count == t->names_cap) {
+		size_t cap = t->names_cap ? 2 * t->names_cap : 64;
+		trace_name_t* names = realloc(t->names, cap * sizeof(*names));
+
+		if (names == NULL)
+			return TRACE_NO_ID;
+		t->names = names;
+		t->names_cap = cap;
+	}
+	if (t->pool_len + len > t->pool_cap) {
+		size_t cap = t->pool_cap ? 2 * t->pool_cap : 4096;
+		char* pool;
+
+		while (cap < t->pool_len + len)
+			cap *= 2;
+		if ((pool = realloc(t->pool, cap)) == NULL)
+			return TRACE_NO_ID;
+		t->pool = pool;
+		t->pool_cap = cap;
+	}
+
+	uint32_t id = t->count++;
+	size_t i = hash & (t->nslots - 1);
+
+	memcpy(t->pool + t->pool_len, name, len);
+	t->names[id] = (trace_name_t){ .off = t->pool_len, .len = len, .hash = hash };
+	t->pool_len += len;
+	while (t->slots[i] != 0)
+		i = (i + 1) & (t->nslots - 1);
+	t->slots[i] = id + 1;
+
+	return id;
+}
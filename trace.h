@@ -0,0 +1,140 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Trace operations
+ */
+typedef enum trace_op_t {
+	TRACE_NONE = 0,    ///< blank line
+	TRACE_ALLOC,       ///< X = alloc(size)
+	TRACE_ALLOC_EXACT, ///< X = alloc_exact(size)
+	TRACE_FREE         ///< free(X)
+} trace_op_t;
+
+/* binary trace format */
+#define TRACE_MAGIC "BUDDYTRC" ///< first 8 bytes of a binary trace
+#define TRACE_VERSION 1
+#define TRACE_TIMESTAMPS 0x1   ///< records are struct trace_record_ts
+#define TRACE_OP_SHIFT 30      ///< the op lives in the top bits of op_handle
+#define TRACE_HANDLE_MASK ((1u << TRACE_OP_SHIFT) - 1)
+
+/**
+ * Header at the start of a binary trace, followed by count records
+ */
+struct trace_header {
+	char magic[8];    ///< TRACE_MAGIC, not NUL terminated
+	uint32_t version; ///< TRACE_VERSION
+	uint32_t flags;   ///< TRACE_* flags
+	uint64_t count;   ///< number of records
+	uint64_t handles; ///< every handle id is below this
+};
+
+/**
+ * One operation of a binary trace
+ */
+struct trace_record {
+	uint32_t op_handle; ///< trace_op_t << TRACE_OP_SHIFT | dense handle id
+	uint32_t size;      ///< requested bytes, 0 for frees
+};
+
+/**
+ * Record of a trace with TRACE_TIMESTAMPS
+ */
+struct trace_record_ts {
+	struct trace_record rec;
+	uint64_t timestamp;  ///< time of the operation, unit and origin are up to the producer
+};
+
+/* raw capture format written by libbuddytrace.so */
+#define TRACE_RAW_MAGIC "BUDDYRAW" ///< first 8 bytes of a raw capture
+#define TRACE_RAW_VERSION 1
+
+/**
+ * Header at the start of a raw capture, followed by chunks
+ */
+struct trace_raw_header {
+	char magic[8];     ///< TRACE_RAW_MAGIC, not NUL terminated
+	uint32_t version;  ///< TRACE_RAW_VERSION
+	uint32_t reserved; ///< zero
+};
+
+/**
+ * One thread's buffer of a raw capture: count records in seq order. Chunks
+ * of different threads interleave, so trace_convert merges them by seq.
+ */
+struct trace_raw_chunk {
+	uint64_t count;
+};
+
+/**
+ * One captured call, keyed by address rather than handle
+ */
+struct trace_raw_record {
+	uint64_t seq;  ///< position in the process-wide order of calls
+	uint64_t ptr;  ///< address allocated or freed
+	uint32_t size; ///< requested bytes (clamped to UINT32_MAX), 0 for frees
+	uint32_t op;   ///< TRACE_ALLOC or TRACE_FREE
+};
+
+/**
+ * A command parsed from a text trace line
+ */
+typedef struct trace_cmd_t {
+	trace_op_t op;
+	const char* name; ///< handle name ([A-Za-z0-9_]+), points into the line
+	size_t name_len;
+	uint64_t size;    ///< requested bytes for allocations
+} trace_cmd_t;
+
+#define TRACE_NO_ID UINT32_MAX ///< trace_name_id() is out of memory
+
+/**
+ * Name of a handle in a trace_names_t, stored in its name pool
+ */
+typedef struct trace_name_t {
+	size_t off;    ///< offset of the name in the pool
+	uint32_t len;  ///< length of the name
+	uint32_t hash; ///< hash of the name
+} trace_name_t;
+
+/**
+ * Maps handle names to dense ids, in order of first appearance, through an
+ * open-addressed hash table
+ */
+typedef struct trace_names_t {
+	uint32_t* slots;     ///< id + 1 of the name hashed here, 0 if empty
+	size_t nslots;       ///< power of two, at least twice count
+	trace_name_t* names; ///< indexed by id
+	uint32_t count;      ///< ids handed out
+	size_t names_cap;
+	char* pool;          ///< the names back to back
+	size_t pool_len;
+	size_t pool_cap;
+} trace_names_t;
+
+/**
+ * Operation of a binary trace record
+ */
+static inline trace_op_t trace_record_op(const struct trace_record* rec)
+{
+	return rec->op_handle >> TRACE_OP_SHIFT;
+}
+
+/**
+ * Handle id of a binary trace record
+ */
+static inline uint32_t trace_record_handle(const struct trace_record* rec)
+{
+	return rec->op_handle & TRACE_HANDLE_MASK;
+}
+
+int trace_parse_line(const char* line, const char* eol, trace_cmd_t* cmd);
+size_t trace_record_size(const struct trace_header* hdr);
+void trace_names_init(trace_names_t* t);
+void trace_names_free(trace_names_t* t);
+uint32_t trace_name_id(trace_names_t* t, const char* name, size_t len);
+
+#endif // TRACE_H
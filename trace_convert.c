@@ -0,0 +1,428 @@
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+/**
+ * Converts a text trace (the simulator's `X = alloc(80K)` / `free(X)`
+ * format), or a raw capture from libbuddytrace.so, into the fixed-width
+ * binary format replayed by `buddy -b`.
+ *
+ * Text handle names become dense ids in order of first appearance; a name
+ * keeps its id when it is reused after a free, exactly like a simulator
+ * variable. A captured address gets the most recently freed id (the free
+ * ids are a stack), or a new one if none is free, so the number of handles
+ * is the peak number of live allocations.
+ */
+
+/**
+ * Cursor over the records of one chunk of a raw capture
+ */
+typedef struct cursor_t {
+	const struct trace_raw_record* rec;
+	uint64_t left;
+} cursor_t;
+
+/**
+ * Open-addressed map from live addresses to handle ids; 0 marks an empty
+ * slot since NULL is never recorded
+ */
+typedef struct ptr_map_t {
+	uint64_t* keys;
+	uint32_t* ids;
+	size_t nslots; ///< power of two, at least twice count
+	size_t count;
+} ptr_map_t;
+
+/**
+ * Append one record to the binary trace
+ *
+ * @param out Output file
+ * @param hdr Header of the trace, whose count is updated
+ * @param op Operation
+ * @param id Handle id
+ * @param size Requested bytes for allocations
+ * @param timestamp Stamp of the record if the trace has TRACE_TIMESTAMPS
+ */
+static void emit(FILE* out, struct trace_header* hdr, trace_op_t op, uint32_t id,
+		 uint32_t size, uint64_t timestamp)
+{
+	struct trace_record_ts rec = {
+		.rec = {
+			.op_handle = (uint32_t)op << TRACE_OP_SHIFT | id,
+			.size = size,
+		},
+		.timestamp = timestamp,
+	};
+
+	fwrite(&rec, trace_record_size(hdr), 1, out);
+	++hdr->count;
+}
+
+/**
+ * Convert a text trace
+ *
+ * @param in Text trace
+ * @param out Output file, positioned after the header
+ * @param hdr Header of the trace, updated with the counts
+ * @return 0 on success, -1 after printing an error
+ */
+static int convert_text(FILE* in, FILE* out, struct trace_header* hdr)
+{
+	trace_names_t names;
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read;
+	long linenum = 0;
+	int ret = 0;
+
+	trace_names_init(&names);
+
+	while (ret == 0 && (read = getline(&line, &len, in)) > 0) {
+		trace_cmd_t cmd;
+		const char* eol = line + read;
+
+		++linenum;
+		if (eol[-1] == '\n')
+			--eol;
+
+		switch (trace_parse_line(line, eol, &cmd)) {
+		case 0:
+			continue;
+		case -1:
+			fprintf(stderr, "ERROR: Line %ld: Failed to parse command\n", linenum);
+			fprintf(stderr, "    Faulting Command: %.*s\n", (int)(eol - line), line);
+			ret = -1;
+			continue;
+		}
+
+		uint32_t id = trace_name_id(&names, cmd.name, cmd.name_len);
+
+		if (id == TRACE_NO_ID || id > TRACE_HANDLE_MASK) {
+			fprintf(stderr, "ERROR: Line %ld: Too many handles\n", linenum);
+			ret = -1;
+			continue;
+		}
+
+		emit(out, hdr, cmd.op, id, cmd.size, linenum);
+	}
+
+	hdr->handles = names.count;
+	trace_names_free(&names);
+	free(line);
+
+	return ret;
+}
+
+/**
+ * Home slot of an address (Fibonacci hashing; allocations are at least 16
+ * byte aligned so the low bits carry nothing)
+ */
+static inline size_t map_home(const ptr_map_t* m, uint64_t key)
+{
+	return (key >> 4) * 0x9e3779b97f4a7c15ull >> 20 & (m->nslots - 1);
+}
+
+/**
+ * Slot of an address in the map, or of the empty slot where it belongs
+ */
+static size_t map_slot(const ptr_map_t* m, uint64_t key)
+{
+	size_t i = map_home(m, key);
+
+	while (m->keys[i] != 0 && m->keys[i] != key)
+		i = (i + 1) & (m->nslots - 1);
+	return i;
+}
+
+/**
+ * Insert an address that is not in the map
+ *
+ * @return 0, or -1 if out of memory
+ */
+static int map_insert(ptr_map_t* m, uint64_t key, uint32_t id)
+{
+	if (2 * (m->count + 1) > m->nslots) {
+		ptr_map_t grown = { .nslots = m->nslots ? 2 * m->nslots : 1024, .count = m->count };
+
+		grown.keys = calloc(grown.nslots, sizeof(uint64_t));
+		grown.ids = calloc(grown.nslots, sizeof(uint32_t));
+		if (grown.keys == NULL || grown.ids == NULL) {
+			free(grown.keys);
+			free(grown.ids);
+			return -1;
+		}
+		for (size_t i = 0; i < m->nslots; ++i) {
+			if (m->keys[i] != 0) {
+				size_t j = map_slot(&grown, m->keys[i]);
+
+				grown.keys[j] = m->keys[i];
+				grown.ids[j] = m->ids[i];
+			}
+		}
+		free(m->keys);
+		free(m->ids);
+		*m = grown;
+	}
+
+	size_t i = map_slot(m, key);
+
+	m->keys[i] = key;
+	m->ids[i] = id;
+	++m->count;
+	return 0;
+}
+
+/**
+ * Remove the address in slot i, shifting later entries of its probe run
+ * back so lookups never stop early
+ */
+static void map_remove(ptr_map_t* m, size_t i)
+{
+	size_t mask = m->nslots - 1;
+	size_t j = i;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if (m->keys[j] == 0)
+			break;
+
+		size_t home = map_home(m, m->keys[j]);
+
+		// Move j into the hole unless its home lies cyclically in (i, j]
+		if (i < j ? (home <= i || home > j) : (home <= i && home > j)) {
+			m->keys[i] = m->keys[j];
+			m->ids[i] = m->ids[j];
+			i = j;
+		}
+	}
+	m->keys[i] = 0;
+	--m->count;
+}
+
+/**
+ * Restore the heap order of the cursors from index i down
+ */
+static void heap_down(cursor_t* heap, size_t n, size_t i)
+{
+	for (;;) {
+		size_t least = i, l = 2 * i + 1, r = l + 1;
+
+		if (l < n && heap[l].rec->seq < heap[least].rec->seq)
+			least = l;
+		if (r < n && heap[r].rec->seq < heap[least].rec->seq)
+			least = r;
+		if (least == i)
+			return;
+
+		cursor_t t = heap[i];
+		heap[i] = heap[least];
+		heap[least] = t;
+		i = least;
+	}
+}
+
+/**
+ * Convert a raw capture
+ *
+ * The chunks are merged by sequence number with a heap of cursors over the
+ * mapped file. Frees of addresses that were never seen (their allocation
+ * was still buffered by a thread running at exit) are dropped, and an
+ * allocation of an address that is still live (its free was lost) frees
+ * the stale handle first.
+ *
+ * @param in Raw capture, which must be a regular file
+ * @param out Output file, positioned after the header
+ * @param hdr Header of the trace, updated with the counts
+ * @return 0 on success, -1 after printing an error
+ */
+static int convert_raw(FILE* in, FILE* out, struct trace_header* hdr)
+{
+	struct stat st;
+	const char* data;
+
+	if (fstat(fileno(in), &st) != 0 || (size_t)st.st_size < sizeof(struct trace_raw_header) ||
+	    (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0)) == MAP_FAILED) {
+		fprintf(stderr, "ERROR: Not a raw capture\n");
+		return -1;
+	}
+	if (memcmp(data, TRACE_RAW_MAGIC, 8) != 0) {
+		fprintf(stderr, "ERROR: Not a raw capture\n");
+		munmap((void*)data, st.st_size);
+		return -1;
+	}
+
+	const char* end = data + st.st_size;
+	const char* p = data + sizeof(struct trace_raw_header);
+	cursor_t* heap = NULL;
+	size_t n = 0, cap = 0;
+	int ret = 0;
+
+	// One cursor per chunk; a chunk cut short at exit keeps what was written
+	while (ret == 0 && (size_t)(end - p) >= sizeof(struct trace_raw_chunk)) {
+		const struct trace_raw_chunk* chunk = (const struct trace_raw_chunk*)p;
+		uint64_t fits = (end - p - sizeof(*chunk)) / sizeof(struct trace_raw_record);
+		uint64_t count = chunk->count < fits ? chunk->count : fits;
+
+		p += sizeof(*chunk) + count * sizeof(struct trace_raw_record);
+		if (count == 0)
+			continue;
+		if (n == cap) {
+			cursor_t* grown = realloc(heap, (cap = cap ? 2 * cap : 64) * sizeof(cursor_t));
+
+			if (grown == NULL) {
+				ret = -1;
+				continue;
+			}
+			heap = grown;
+		}
+		heap[n++] = (cursor_t){ (const struct trace_raw_record*)(chunk + 1), count };
+	}
+	for (size_t i = n / 2; i-- > 0; )
+		heap_down(heap, n, i);
+
+	ptr_map_t map = { 0 };
+	uint32_t* free_ids = NULL;
+	size_t nfree = 0, free_cap = 0;
+	uint32_t handles = 0;
+	uint64_t dropped = 0, repaired = 0;
+
+	while (ret == 0 && n > 0) {
+		const struct trace_raw_record* rec = heap[0].rec;
+		size_t slot = map.nslots ? map_slot(&map, rec->ptr) : 0;
+
+		if (map.nslots && map.keys[slot] == rec->ptr) {
+			uint32_t id = map.ids[slot];
+
+			if (rec->op != TRACE_FREE)
+				++repaired;
+			emit(out, hdr, TRACE_FREE, id, 0, rec->seq);
+			map_remove(&map, slot);
+			if (nfree == free_cap) {
+				uint32_t* grown = realloc(free_ids, (free_cap = free_cap ? 2 * free_cap : 1024) *
+							  sizeof(uint32_t));
+
+				if (grown == NULL) {
+					ret = -1;
+					continue;
+				}
+				free_ids = grown;
+			}
+			free_ids[nfree++] = id;
+		}
+		else if (rec->op == TRACE_FREE) {
+			++dropped;
+		}
+
+		if (rec->op != TRACE_FREE) {
+			uint32_t id = nfree > 0 ? free_ids[--nfree] : handles++;
+
+			if (id > TRACE_HANDLE_MASK || map_insert(&map, rec->ptr, id) != 0) {
+				ret = -1;
+				continue;
+			}
+			emit(out, hdr, rec->op, id, rec->size, rec->seq);
+		}
+
+		if (--heap[0].left == 0)
+			heap[0] = heap[--n];
+		else
+			++heap[0].rec;
+		heap_down(heap, n, 0);
+	}
+
+	if (ret != 0)
+		fprintf(stderr, "ERROR: Out of memory or handles\n");
+	else if (dropped > 0 || repaired > 0)
+		fprintf(stderr, "WARNING: %llu frees of unknown addresses dropped, %llu lost frees added\n",
+			(unsigned long long)dropped, (unsigned long long)repaired);
+
+	hdr->handles = handles;
+	free(free_ids);
+	free(map.keys);
+	free(map.ids);
+	free(heap);
+	munmap((void*)data, st.st_size);
+
+	return ret;
+}
+
+/**
+ * Output program manual
+ *
+ * @param prog_name Name of the program passed in as a command line argument.
+ * @param out File stream to write to.
+ */
+static void print_usage(char* prog_name, FILE* out)
+{
+	fprintf(out, "Usage:\n");
+	fprintf(out, "  %s [-R] [-i filename] -o filename [-t]\n", prog_name);
+	fprintf(out, "     -R [optional] - The input is a raw capture from libbuddytrace.so.\n");
+	fprintf(out, "     -i [optional] - Trace to read (default standard input, a file for -R).\n");
+	fprintf(out, "     -o            - Binary trace to write.\n");
+	fprintf(out, "     -t [optional] - Write timestamped records, stamped with the line\n");
+	fprintf(out, "                     number (text) or sequence number (raw).\n");
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	FILE* in = stdin;
+	FILE* out = NULL;
+	bool raw = false;
+	struct trace_header hdr = { .version = TRACE_VERSION };
+
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+
+	while ((opt = getopt(argc, argv, "Ri:o:t")) != -1) {
+		switch (opt) {
+		case 'R':
+			raw = true;
+			break;
+		case 'i':
+			if ((in = fopen(optarg, "r")) == NULL) {
+				perror("ERROR: Failed to open input file");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if ((out = fopen(optarg, "wb")) == NULL) {
+				perror("ERROR: Failed to open output file");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			hdr.flags |= TRACE_TIMESTAMPS;
+			break;
+		default:
+			print_usage(argv[0], stderr);
+			return EXIT_FAILURE;
+		}
+	}
+	if (out == NULL) {
+		print_usage(argv[0], stderr);
+		return EXIT_FAILURE;
+	}
+
+	// The header is rewritten with the final counts once the input is done
+	fwrite(&hdr, sizeof(hdr), 1, out);
+
+	if ((raw ? convert_raw(in, out, &hdr) : convert_text(in, out, &hdr)) != 0)
+		return EXIT_FAILURE;
+
+	if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+	    fclose(out) != 0) {
+		perror("ERROR: Failed to write output file");
+		return EXIT_FAILURE;
+	}
+
+	if (in != stdin)
+		fclose(in);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/**
+ * Allocation trace recorder, built as libbuddytrace.so for LD_PRELOAD:
+ *
+ *     LD_PRELOAD=./libbuddytrace.so BUDDY_TRACE_FILE=app.raw ./service
+ *     ./trace_convert -R -i app.raw -o app.bin
+ *     ./buddy -b -i app.bin
+ *
+ * Every malloc-family call is forwarded to glibc and appended, with a
+ * process-wide sequence number, to a buffer owned by the calling thread, so
+ * recording takes no lock. A full buffer is pushed onto a lock-free stack
+ * for a flusher thread, which writes it out as one chunk of the raw capture
+ * format in trace.h; the converter later merges the chunks by sequence
+ * number and maps addresses to handle ids. realloc() is recorded as a free
+ * of the old address followed by an allocation of the new one.
+ *
+ * The buffers of threads that exit are flushed by a thread-specific data
+ * destructor and the calling thread's one at process exit; records still
+ * buffered by threads running at exit are lost, which the converter
+ * tolerates. Child processes, forked or spawned, record into files of
+ * their own.
+ */
+
+#define BUF_RECORDS 16384 ///< records per thread buffer
+
+/* glibc's allocator, which this library records and forwards to */
+extern void* __libc_malloc(size_t size);
+extern void __libc_free(void* addr);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* addr, size_t size);
+extern void* __libc_memalign(size_t align, size_t size);
+
+/**
+ * A thread's record buffer, written out as one trace_raw_chunk
+ */
+typedef struct buffer_t {
+	struct buffer_t* next; ///< on the full stack
+	struct trace_raw_chunk chunk;
+	struct trace_raw_record recs[BUF_RECORDS];
+} buffer_t;
+
+static atomic_uint_fast64_t seq;     ///< next sequence number
+static _Atomic(buffer_t*) full;      ///< buffers waiting for the flusher
+static sem_t full_sem;               ///< posted once per pushed buffer
+static atomic_ulong pushed, written; ///< buffers handed over and written out
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static int out_fd = -1;              ///< the capture file
+static pthread_t flusher;
+static pthread_key_t buffer_key;
+static bool recording;               ///< set once the recorder is running
+
+static __thread buffer_t* cur;       ///< the calling thread's buffer
+static __thread bool busy;           ///< inside the recorder, do not record
+
+/**
+ * Write a whole buffer to the capture file
+ */
+static void write_all(const void* data, size_t len)
+{
+	const char* p = data;
+
+	while (len > 0) {
+		ssize_t n = write(out_fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		p += n;
+		len -= n;
+	}
+}
+
+/**
+ * Write a buffer as a chunk and release it
+ */
+static void write_buffer(buffer_t* buf)
+{
+	pthread_mutex_lock(&write_lock);
+	if (buf->chunk.count > 0)
+		write_all(&buf->chunk, sizeof(buf->chunk) +
+			  buf->chunk.count * sizeof(struct trace_raw_record));
+	pthread_mutex_unlock(&write_lock);
+	munmap(buf, sizeof(*buf));
+	atomic_fetch_add(&written, 1);
+}
+
+/**
+ * Hand a buffer to the flusher (Treiber stack push)
+ */
+static void push_full(buffer_t* buf)
+{
+	buffer_t* head = atomic_load_explicit(&full, memory_order_relaxed);
+
+	do {
+		buf->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&full, &head, buf,
+							memory_order_release,
+							memory_order_relaxed));
+	atomic_fetch_add(&pushed, 1);
+	sem_post(&full_sem);
+}
+
+/**
+ * Write every pushed buffer; the whole stack is taken at once, so no pop
+ * can suffer from ABA
+ */
+static void drain_full(void)
+{
+	buffer_t* buf = atomic_exchange_explicit(&full, NULL, memory_order_acquire);
+
+	while (buf != NULL) {
+		buffer_t* next = buf->next;
+
+		write_buffer(buf);
+		buf = next;
+	}
+}
+
+static void* flusher_main(void* arg)
+{
+	(void)arg;
+	busy = true;
+
+	for (;;) {
+		while (sem_wait(&full_sem) != 0 && errno == EINTR)
+			;
+		drain_full();
+	}
+
+	return NULL;
+}
+
+/**
+ * Thread exit: hand the thread's partial buffer to the flusher
+ */
+static void buffer_destroy(void* arg)
+{
+	buffer_t* buf = arg;
+
+	if (buf != NULL && buf == cur) {
+		cur = NULL;
+		push_full(buf);
+	}
+}
+
+/**
+ * Append one record to the calling thread's buffer
+ *
+ * @param seqno Sequence number of the call
+ * @param op TRACE_ALLOC or TRACE_FREE
+ * @param ptr Address allocated or freed
+ * @param size Requested bytes for allocations
+ */
+static void record(uint64_t seqno, trace_op_t op, void* ptr, size_t size)
+{
+	buffer_t* buf = cur;
+
+	if (buf == NULL) {
+		busy = true;
+		buf = mmap(NULL, sizeof(*buf), PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buf == MAP_FAILED) {
+			busy = false;
+			return;
+		}
+		cur = buf;
+		pthread_setspecific(buffer_key, buf);
+		busy = false;
+	}
+
+	buf->recs[buf->chunk.count++] = (struct trace_raw_record){
+		.seq = seqno,
+		.ptr = (uintptr_t)ptr,
+		.size = size > UINT32_MAX ? UINT32_MAX : size,
+		.op = op,
+	};
+
+	if (buf->chunk.count == BUF_RECORDS) {
+		cur = NULL;
+		pthread_setspecific(buffer_key, NULL);
+		push_full(buf);
+	}
+}
+
+static inline bool should_record(void)
+{
+	return recording && !busy;
+}
+
+static inline uint64_t next_seq(void)
+{
+	return atomic_fetch_add_explicit(&seq, 1, memory_order_relaxed);
+}
+
+/**
+ * Open the capture file and start the flusher
+ *
+ * The file is BUDDY_TRACE_FILE, which is then dropped from the environment
+ * so child processes do not overwrite it, or buddy-trace.<pid>.raw.
+ */
+static void start_recording(void)
+{
+	char path[4096];
+	const char* env = getenv("BUDDY_TRACE_FILE");
+	struct trace_raw_header hdr = { .version = TRACE_RAW_VERSION };
+
+	if (env != NULL) {
+		snprintf(path, sizeof(path), "%s", env);
+		unsetenv("BUDDY_TRACE_FILE");
+	}
+	else {
+		snprintf(path, sizeof(path), "buddy-trace.%d.raw", (int)getpid());
+	}
+
+	out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out_fd < 0)
+		return;
+
+	memcpy(hdr.magic, TRACE_RAW_MAGIC, sizeof(hdr.magic));
+	write_all(&hdr, sizeof(hdr));
+
+	busy = true;
+	if (pthread_create(&flusher, NULL, flusher_main, NULL) == 0)
+		recording = true;
+	busy = false;
+}
+
+/**
+ * A forked child starts over with a file of its own; the parent still owns
+ * every record buffered before the fork
+ */
+static void after_fork_child(void)
+{
+	recording = false;
+	atomic_store(&full, NULL);
+	atomic_store(&pushed, 0);
+	atomic_store(&written, 0);
+	if (cur != NULL)
+		cur->chunk.count = 0;
+	sem_init(&full_sem, 0, 0);
+	pthread_mutex_init(&write_lock, NULL);
+	close(out_fd);
+	start_recording();
+}
+
+__attribute__((constructor))
+static void recorder_init(void)
+{
+	busy = true;
+	sem_init(&full_sem, 0, 0);
+	pthread_key_create(&buffer_key, buffer_destroy);
+	pthread_atfork(NULL, NULL, after_fork_child);
+	busy = false;
+	start_recording();
+}
+
+__attribute__((destructor))
+static void recorder_fini(void)
+{
+	if (!recording)
+		return;
+
+	recording = false;
+	if (cur != NULL) {
+		buffer_t* buf = cur;
+
+		cur = NULL;
+		push_full(buf);
+	}
+	drain_full();
+
+	// Give the flusher up to a second to finish the buffers it took
+	for (int i = 0; i < 1000 && atomic_load(&written) < atomic_load(&pushed); ++i)
+		usleep(1000);
+}
+
+void* malloc(size_t size)
+{
+	void* addr = __libc_malloc(size);
+
+	if (addr != NULL && should_record())
+		record(next_seq(), TRACE_ALLOC, addr, size);
+	return addr;
+}
+
+void free(void* addr)
+{
+	// The number is taken before the memory can be handed out again
+	if (addr != NULL && should_record())
+		record(next_seq(), TRACE_FREE, addr, 0);
+	__libc_free(addr);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+	void* addr = __libc_calloc(nmemb, size);
+
+	if (addr != NULL && should_record())
+		record(next_seq(), TRACE_ALLOC, addr, nmemb * size);
+	return addr;
+}
+
+void* realloc(void* addr, size_t size)
+{
+	if (addr == NULL || !should_record())
+		return addr == NULL ? malloc(size) : __libc_realloc(addr, size);
+
+	uint64_t freed = next_seq();
+	void* moved = __libc_realloc(addr, size);
+
+	if (moved != NULL || size == 0) {
+		record(freed, TRACE_FREE, addr, 0);
+		if (moved != NULL)
+			record(next_seq(), TRACE_ALLOC, moved, size);
+	}
+	return moved;
+}
+
+void* reallocarray(void* addr, size_t nmemb, size_t size)
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(addr, total);
+}
+
+void* memalign(size_t align, size_t size)
+{
+	void* addr = __libc_memalign(align, size);
+
+	if (addr != NULL && should_record())
+		record(next_seq(), TRACE_ALLOC, addr, size);
+	return addr;
+}
+
+void* aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+int posix_memalign(void** memptr, size_t align, size_t size)
+{
+	if (align < sizeof(void*) || (align & (align - 1)) != 0)
+		return EINVAL;
+
+	void* addr = memalign(align, size);
+
+	if (addr == NULL)
+		return ENOMEM;
+	*memptr = addr;
+	return 0;
+}
+
+void* valloc(size_t size)
+{
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return memalign(page, (size + page - 1) & ~(page - 1));
+}